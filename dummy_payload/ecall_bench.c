@@ -0,0 +1,74 @@
+// See LICENSE for license details.
+
+// A payload that times SBI calls, to measure what a trap into bbl costs.
+// Configure with --with-payload=ecall_bench to run it in place of
+// dummy_payload.
+
+#include "mcall.h"
+#include <stdint.h>
+
+#define CALLS 10000
+#define SBI_NONE 0x7ff // not a call bbl knows, so it takes the full path
+
+static uintptr_t sbi_call(uintptr_t which, uintptr_t arg0, uintptr_t arg1)
+{
+  register uintptr_t a0 asm ("a0") = arg0;
+  register uintptr_t a1 asm ("a1") = arg1;
+  register uintptr_t a7 asm ("a7") = which;
+  asm volatile ("ecall" : "+r" (a0) : "r" (a1), "r" (a7) : "memory");
+  return a0;
+}
+
+static inline uintptr_t rdcycle()
+{
+  uintptr_t cycles;
+  asm volatile ("rdcycle %0" : "=r" (cycles));
+  return cycles;
+}
+
+static void print(const char* s)
+{
+  while (*s)
+    sbi_call(SBI_CONSOLE_PUTCHAR, *s++, 0);
+}
+
+static void print_num(uintptr_t n)
+{
+  char buf[24], *p = buf + sizeof(buf);
+  *--p = 0;
+  do
+    *--p = '0' + n % 10;
+  while (n /= 10);
+  print(p);
+}
+
+static void bench(const char* name, uintptr_t which, uintptr_t arg)
+{
+  uintptr_t start = rdcycle();
+  for (int i = 0; i < CALLS; i++)
+    sbi_call(which, arg, arg);
+  uintptr_t cycles = rdcycle() - start;
+
+  print(name);
+  print(": ");
+  print_num(cycles / CALLS);
+  print(" cycles per call\n");
+}
+
+void bench_main()
+{
+  bench("SBI_SET_TIMER", SBI_SET_TIMER, -1);
+  bench("SBI_CLEAR_IPI", SBI_CLEAR_IPI, 0);
+  bench("unknown SBI call", SBI_NONE, 0);
+  sbi_call(SBI_SHUTDOWN, 0, 0);
+}
+
+static char stack[4096] __attribute__((aligned(16), used));
+
+// bbl enters here, in S-mode, without a stack
+asm (".section .text.init, \"ax\", @progbits\n"
+     ".globl _start\n"
+     "_start:\n"
+     "  la sp, stack + 4096\n"
+     "  j bench_main\n"
+     ".previous");
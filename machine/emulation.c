@@ -5,6 +5,7 @@
 #include "config.h"
 #include "unprivileged_memory.h"
 #include "mtrap.h"
+#include "pk.h"
 #include <limits.h>
 
 static DECLARE_EMULATION_FUNC(emulate_rvc)
@@ -68,6 +69,315 @@ static DECLARE_EMULATION_FUNC(emulate_rvc)
   return truly_illegal_insn(regs, mcause, mepc, mstatus, insn);
 }
 
+#if (!defined(__riscv_flen) && defined(PK_ENABLE_FP_EMULATION)) || !defined(__riscv_muldiv)
+# define EMULATE_RUN_AHEAD
+#endif
+
+#ifdef EMULATE_RUN_AHEAD
+// Once an FP or M instruction has trapped, the ones after it are likely to
+// trap too, so rather than return to each, keep emulating them, along with
+// the integer arithmetic, loads and stores among them, until the next
+// branch or anything else we can't do here.
+
+#define MAX_RUN_AHEAD 128
+
+#define OPCODE_LOAD      0x03
+#define OPCODE_LOAD_FP   0x07
+#define OPCODE_OP_IMM    0x13
+#define OPCODE_AUIPC     0x17
+#define OPCODE_OP_IMM_32 0x1b
+#define OPCODE_STORE     0x23
+#define OPCODE_STORE_FP  0x27
+#define OPCODE_OP        0x33
+#define OPCODE_LUI       0x37
+#define OPCODE_OP_32     0x3b
+#define OPCODE_MADD      0x43
+#define OPCODE_MSUB      0x47
+#define OPCODE_NMSUB     0x4b
+#define OPCODE_NMADD     0x4f
+#define OPCODE_OP_FP     0x53
+
+#define ENCODE_R(op, funct3, funct7, rd, rs1, rs2) \
+  ((insn_t)(op) | ((funct3) << 12) | ((rd) << SH_RD) | ((rs1) << SH_RS1) | \
+   ((rs2) << SH_RS2) | ((insn_t)(funct7) << 25))
+#define ENCODE_I(op, funct3, rd, rs1, imm) \
+  ((insn_t)(op) | ((funct3) << 12) | ((rd) << SH_RD) | ((rs1) << SH_RS1) | \
+   ((insn_t)((imm) & 0xfff) << 20))
+#define ENCODE_S(op, funct3, rs1, rs2, imm) \
+  ((insn_t)(op) | ((funct3) << 12) | (((imm) & 0x1f) << SH_RD) | \
+   ((rs1) << SH_RS1) | ((rs2) << SH_RS2) | ((insn_t)(((imm) >> 5) & 0x7f) << 25))
+
+#define RVC_IMM(x) ((int)RV_X(x, 2, 5) - ((int)RV_X(x, 12, 1) << 5))
+#define RVC_SHAMT(x) (RV_X(x, 2, 5) | (RV_X(x, 12, 1) << 5))
+#define RVC_ADDI4SPN_IMM(x) ((RV_X(x, 6, 1) << 2) | (RV_X(x, 5, 1) << 3) | (RV_X(x, 11, 2) << 4) | (RV_X(x, 7, 4) << 6))
+
+// The emulator for an FP or M instruction, or NULL for anything else
+static emulation_func run_ahead_func(insn_t insn)
+{
+  switch (insn & 0x7f)
+  {
+#if !defined(__riscv_flen) && defined(PK_ENABLE_FP_EMULATION)
+    case OPCODE_LOAD_FP: return emulate_float_load;
+    case OPCODE_STORE_FP: return emulate_float_store;
+    case OPCODE_MADD:
+    case OPCODE_MSUB:
+    case OPCODE_NMSUB:
+    case OPCODE_NMADD: return emulate_fmadd;
+    case OPCODE_OP_FP: return emulate_fp;
+#endif
+#ifndef __riscv_muldiv
+    case OPCODE_OP: return RV_X(insn, 25, 7) == 1 ? emulate_mul_div : NULL;
+# if __riscv_xlen == 64
+    case OPCODE_OP_32: return RV_X(insn, 25, 7) == 1 ? emulate_mul_div32 : NULL;
+# endif
+#endif
+  }
+  return NULL;
+}
+
+// The 32-bit equivalent of a compressed instruction, or 0 if it's one
+// that run-ahead stops at.
+static insn_t rvc_expand(insn_t x)
+{
+  int rd = RV_X(x, SH_RD, 5), rs2 = RVC_RS2(x);
+  int rs1s = RVC_RS1S(x), rs2s = RVC_RS2S(x);
+
+  switch (((x & 3) << 3) | RV_X(x, 13, 3))
+  {
+    case 0: // C.ADDI4SPN
+      if (RVC_ADDI4SPN_IMM(x) == 0)
+        return 0;
+      return ENCODE_I(OPCODE_OP_IMM, 0, rs2s, 2, RVC_ADDI4SPN_IMM(x));
+    case 1: return ENCODE_I(OPCODE_LOAD_FP, 3, rs2s, rs1s, RVC_LD_IMM(x));
+    case 2: return ENCODE_I(OPCODE_LOAD, 2, rs2s, rs1s, RVC_LW_IMM(x));
+#if __riscv_xlen == 64
+    case 3: return ENCODE_I(OPCODE_LOAD, 3, rs2s, rs1s, RVC_LD_IMM(x));
+#else
+    case 3: return ENCODE_I(OPCODE_LOAD_FP, 2, rs2s, rs1s, RVC_LW_IMM(x));
+#endif
+    case 5: return ENCODE_S(OPCODE_STORE_FP, 3, rs1s, rs2s, RVC_LD_IMM(x));
+    case 6: return ENCODE_S(OPCODE_STORE, 2, rs1s, rs2s, RVC_LW_IMM(x));
+#if __riscv_xlen == 64
+    case 7: return ENCODE_S(OPCODE_STORE, 3, rs1s, rs2s, RVC_LD_IMM(x));
+#else
+    case 7: return ENCODE_S(OPCODE_STORE_FP, 2, rs1s, rs2s, RVC_LW_IMM(x));
+#endif
+    case 8: return ENCODE_I(OPCODE_OP_IMM, 0, rd, rd, RVC_IMM(x)); // C.ADDI
+#if __riscv_xlen == 64
+    case 9: // C.ADDIW
+      if (rd == 0)
+        return 0;
+      return ENCODE_I(OPCODE_OP_IMM_32, 0, rd, rd, RVC_IMM(x));
+#endif
+    case 10: return ENCODE_I(OPCODE_OP_IMM, 0, rd, 0, RVC_IMM(x)); // C.LI
+    case 12:
+      switch (RV_X(x, 10, 2))
+      {
+        case 0: return ENCODE_I(OPCODE_OP_IMM, 5, rs1s, rs1s, RVC_SHAMT(x));
+        case 1: return ENCODE_I(OPCODE_OP_IMM, 5, rs1s, rs1s, RVC_SHAMT(x) | 0x400);
+        case 2: return ENCODE_I(OPCODE_OP_IMM, 7, rs1s, rs1s, RVC_IMM(x));
+      }
+      if (RV_X(x, 12, 1) == 0) {
+        // C.SUB, C.XOR, C.OR, C.AND
+        static const uint8_t funct3[] = {0, 4, 6, 7};
+        int op = RV_X(x, 5, 2);
+        return ENCODE_R(OPCODE_OP, funct3[op], op == 0 ? 0x20 : 0, rs1s, rs1s, rs2s);
+      }
+#if __riscv_xlen == 64
+      if (RV_X(x, 5, 2) < 2) // C.SUBW, C.ADDW
+        return ENCODE_R(OPCODE_OP_32, 0, RV_X(x, 5, 2) == 0 ? 0x20 : 0, rs1s, rs1s, rs2s);
+#endif
+      return 0;
+    case 16: return ENCODE_I(OPCODE_OP_IMM, 1, rd, rd, RVC_SHAMT(x)); // C.SLLI
+    case 17: return ENCODE_I(OPCODE_LOAD_FP, 3, rd, 2, RVC_LDSP_IMM(x));
+    case 18: return rd ? ENCODE_I(OPCODE_LOAD, 2, rd, 2, RVC_LWSP_IMM(x)) : 0;
+#if __riscv_xlen == 64
+    case 19: return rd ? ENCODE_I(OPCODE_LOAD, 3, rd, 2, RVC_LDSP_IMM(x)) : 0;
+#else
+    case 19: return ENCODE_I(OPCODE_LOAD_FP, 2, rd, 2, RVC_LWSP_IMM(x));
+#endif
+    case 20: // C.MV, C.ADD; not C.JR, C.JALR or C.EBREAK
+      if (rs2 == 0)
+        return 0;
+      return ENCODE_R(OPCODE_OP, 0, 0, rd, RV_X(x, 12, 1) ? rd : 0, rs2);
+    case 21: return ENCODE_S(OPCODE_STORE_FP, 3, 2, rs2, RVC_SDSP_IMM(x));
+    case 22: return ENCODE_S(OPCODE_STORE, 2, 2, rs2, RVC_SWSP_IMM(x));
+#if __riscv_xlen == 64
+    case 23: return ENCODE_S(OPCODE_STORE, 3, 2, rs2, RVC_SDSP_IMM(x));
+#else
+    case 23: return ENCODE_S(OPCODE_STORE_FP, 2, 2, rs2, RVC_SWSP_IMM(x));
+#endif
+  }
+  return 0;
+}
+
+// Emulate an RV32I/RV64I computational instruction, load or store.
+// Returns 0, having done nothing, if insn is anything else, or a load or
+// store that's misaligned.
+static int emulate_int(uintptr_t* regs, uintptr_t mepc, insn_t insn)
+{
+  uintptr_t rs1 = GET_RS1(insn, regs), rs2 = GET_RS2(insn, regs), val;
+  intptr_t imm = IMM_I(insn);
+  int funct3 = (insn & MASK_FUNCT3) >> 12, funct7 = RV_X(insn, 25, 7);
+  int shamt = imm & (__riscv_xlen - 1);
+
+  switch (insn & 0x7f)
+  {
+    case OPCODE_LUI:
+      val = (int32_t)(insn & 0xfffff000);
+      break;
+    case OPCODE_AUIPC:
+      val = mepc + (int32_t)(insn & 0xfffff000);
+      break;
+    case OPCODE_OP_IMM:
+      switch (funct3)
+      {
+        case 0: val = rs1 + imm; break;
+        case 1: if (imm != shamt) return 0; val = rs1 << shamt; break;
+        case 2: val = (intptr_t)rs1 < imm; break;
+        case 3: val = rs1 < (uintptr_t)imm; break;
+        case 4: val = rs1 ^ imm; break;
+        case 5:
+          if ((imm & ~0x400) != shamt) return 0;
+          val = (imm & 0x400) ? (uintptr_t)((intptr_t)rs1 >> shamt) : rs1 >> shamt;
+          break;
+        case 6: val = rs1 | imm; break;
+        default: val = rs1 & imm; break;
+      }
+      break;
+    case OPCODE_OP:
+      if (funct7 != 0 && !(funct7 == 0x20 && (funct3 == 0 || funct3 == 5)))
+        return 0;
+      shamt = rs2 & (__riscv_xlen - 1);
+      switch (funct3)
+      {
+        case 0: val = funct7 ? rs1 - rs2 : rs1 + rs2; break;
+        case 1: val = rs1 << shamt; break;
+        case 2: val = (intptr_t)rs1 < (intptr_t)rs2; break;
+        case 3: val = rs1 < rs2; break;
+        case 4: val = rs1 ^ rs2; break;
+        case 5: val = funct7 ? (uintptr_t)((intptr_t)rs1 >> shamt) : rs1 >> shamt; break;
+        case 6: val = rs1 | rs2; break;
+        default: val = rs1 & rs2; break;
+      }
+      break;
+#if __riscv_xlen == 64
+    case OPCODE_OP_IMM_32:
+      shamt = imm & 0x1f;
+      if (funct3 == 0)
+        val = (int32_t)(rs1 + imm);
+      else if (funct3 == 1 && funct7 == 0)
+        val = (int32_t)((uint32_t)rs1 << shamt);
+      else if (funct3 == 5 && funct7 == 0)
+        val = (int32_t)((uint32_t)rs1 >> shamt);
+      else if (funct3 == 5 && funct7 == 0x20)
+        val = (int32_t)rs1 >> shamt;
+      else
+        return 0;
+      break;
+    case OPCODE_OP_32:
+      shamt = rs2 & 0x1f;
+      if (funct3 == 0 && funct7 == 0)
+        val = (int32_t)(rs1 + rs2);
+      else if (funct3 == 0 && funct7 == 0x20)
+        val = (int32_t)(rs1 - rs2);
+      else if (funct3 == 1 && funct7 == 0)
+        val = (int32_t)((uint32_t)rs1 << shamt);
+      else if (funct3 == 5 && funct7 == 0)
+        val = (int32_t)((uint32_t)rs1 >> shamt);
+      else if (funct3 == 5 && funct7 == 0x20)
+        val = (int32_t)rs1 >> shamt;
+      else
+        return 0;
+      break;
+#endif
+    case OPCODE_LOAD: {
+      uintptr_t addr = rs1 + imm;
+      if (addr & ((1 << (funct3 & 3)) - 1))
+        return 0;
+      switch (funct3)
+      {
+        case 0: val = load_int8_t((void*)addr, mepc); break;
+        case 1: val = load_int16_t((void*)addr, mepc); break;
+        case 2: val = load_int32_t((void*)addr, mepc); break;
+        case 4: val = load_uint8_t((void*)addr, mepc); break;
+        case 5: val = load_uint16_t((void*)addr, mepc); break;
+#if __riscv_xlen == 64
+        case 3: val = load_uint64_t((void*)addr, mepc); break;
+        case 6: val = load_uint32_t((void*)addr, mepc); break;
+#endif
+        default: return 0;
+      }
+      break;
+    }
+    case OPCODE_STORE: {
+      uintptr_t addr = rs1 + IMM_S(insn);
+      if (addr & ((1 << (funct3 & 3)) - 1))
+        return 0;
+      switch (funct3)
+      {
+        case 0: store_uint8_t((void*)addr, rs2, mepc); break;
+        case 1: store_uint16_t((void*)addr, rs2, mepc); break;
+        case 2: store_uint32_t((void*)addr, rs2, mepc); break;
+#if __riscv_xlen == 64
+        case 3: store_uint64_t((void*)addr, rs2, mepc); break;
+#endif
+        default: return 0;
+      }
+      return 1;
+    }
+    default:
+      return 0;
+  }
+
+  SET_RD(insn, regs, val);
+  return 1;
+}
+
+#endif
+
+static emulation_func insn_handler(insn_t insn)
+{
+  if ((insn & 3) != 3)
+    return emulate_rvc;
+
+  extern uint32_t illegal_insn_trap_table[];
+  int32_t* pf = (void*)illegal_insn_trap_table + (insn & 0x7c);
+  return (emulation_func)((void*)illegal_insn_trap_table + *pf);
+}
+
+#ifdef EMULATE_RUN_AHEAD
+static void emulate_run_ahead(uintptr_t* regs, uintptr_t mcause, uintptr_t trap_pc)
+{
+  for (int i = 0; i < MAX_RUN_AHEAD; i++) {
+    // x0's slot may have been written as a destination
+    regs[0] = 0;
+
+    // Only the trapping instruction's page is known to be executable, and
+    // a pending interrupt shouldn't wait for us.
+    uintptr_t mepc = read_csr(mepc), mstatus;
+    if ((((mepc + 3) ^ trap_pc) >> RISCV_PGSHIFT) || (read_csr(mip) & read_csr(mie)))
+      return;
+
+    insn_t fetched = get_insn(mepc, &mstatus);
+    insn_t insn = (fetched & 3) == 3 ? fetched : rvc_expand(fetched);
+    uintptr_t npc = mepc + insn_len(fetched);
+    if (!insn)
+      return;
+
+    emulation_func f = run_ahead_func(insn);
+    if (f) {
+      write_csr(mepc, npc);
+      f(regs, mcause, mepc, mstatus, insn);
+    } else if (emulate_int(regs, mepc, insn)) {
+      write_csr(mepc, npc);
+    } else {
+      return;
+    }
+  }
+}
+#endif
+
 void illegal_insn_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
 {
   asm (".pushsection .rodata\n"
@@ -132,20 +442,18 @@ void illegal_insn_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
 
   uintptr_t mstatus = read_csr(mstatus);
   insn_t insn = read_csr(mbadaddr);
+  if (unlikely(insn == 0))
+    insn = get_insn(mepc, &mstatus);
+  emulation_func f = insn_handler(insn);
 
-  if (unlikely((insn & 3) != 3)) {
-    if (insn == 0)
-      insn = get_insn(mepc, &mstatus);
-    if ((insn & 3) != 3)
-      return emulate_rvc(regs, mcause, mepc, mstatus, insn);
-  }
-
-  write_csr(mepc, mepc + 4);
-
-  extern uint32_t illegal_insn_trap_table[];
-  int32_t* pf = (void*)illegal_insn_trap_table + (insn & 0x7c);
-  emulation_func f = (emulation_func)((void*)illegal_insn_trap_table + *pf);
+  write_csr(mepc, mepc + insn_len(insn));
   f(regs, mcause, mepc, mstatus, insn);
+
+#ifdef EMULATE_RUN_AHEAD
+  // emulate_rvc returns only having emulated an FP load or store
+  if (f == emulate_rvc || run_ahead_func(insn))
+    emulate_run_ahead(regs, mcause, mepc);
+#endif
 }
 
 __attribute__((noinline))
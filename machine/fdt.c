@@ -208,6 +208,7 @@ void query_mem(uintptr_t fdt)
 
 static uint32_t hart_phandles[MAX_HARTS];
 uint64_t hart_mask;
+static int cpus_seen;
 
 struct hart_scan {
   const struct fdt_scan_node *cpu;
@@ -215,13 +216,27 @@ struct hart_scan {
   const struct fdt_scan_node *controller;
   int cells;
   uint32_t phandle;
+  int zicboz;
+  uint32_t cboz_size;
 };
 
+// Does an ISA string such as "rv64imafdc_zicsr_zicboz" list extension ext?
+static int isa_has_ext(const char *isa, const char *ext)
+{
+  size_t len = strlen(ext);
+  for (const char *p = isa; *p; p++)
+    if (*p == '_' && !strncmp(p + 1, ext, len) && (p[len + 1] == '_' || p[len + 1] == '\0'))
+      return 1;
+  return 0;
+}
+
 static void hart_open(const struct fdt_scan_node *node, void *extra)
 {
   struct hart_scan *scan = (struct hart_scan *)extra;
   if (!scan->cpu) {
     scan->hart = -1;
+    scan->zicboz = 0;
+    scan->cboz_size = 0;
   }
   if (!scan->controller) {
     scan->cells = 0;
@@ -246,6 +261,17 @@ static void hart_prop(const struct fdt_scan_prop *prop, void *extra)
     uint64_t reg;
     fdt_get_address(prop->node->parent, prop->value, &reg);
     scan->hart = reg;
+  } else if (!strcmp(prop->name, "riscv,isa")) {
+    scan->zicboz |= isa_has_ext((const char*)prop->value, "zicboz");
+  } else if (!strcmp(prop->name, "riscv,isa-extensions")) {
+    scan->zicboz |= fdt_string_list_index(prop, "zicboz") >= 0;
+  } else if (!strcmp(prop->name, "riscv,cboz-block-size")) {
+    scan->cboz_size = bswap(prop->value[0]);
+  } else if (!strcmp(prop->name, "timebase-frequency")) {
+    // on /cpus, or on each cpu; the rate of the time CSR either way
+    timebase_freq = prop->len >= 8 ?
+      ((uint64_t)bswap(prop->value[0]) << 32) | bswap(prop->value[1]) :
+      bswap(prop->value[0]);
   }
 }
 
@@ -255,6 +281,19 @@ static void hart_done(const struct fdt_scan_node *node, void *extra)
 
   if (scan->cpu == node) {
     assert (scan->hart >= 0);
+
+    // Only use cbo.zero if every hart has it, with the same block size.
+    // Like Linux, require the block size to be given rather than guess it.
+    uint32_t size = 0;
+    if (scan->zicboz) {
+      size = scan->cboz_size;
+      if ((size & (size - 1)) || size < sizeof(uintptr_t) || size > RISCV_PGSIZE)
+        size = 0;
+    }
+    if (cpus_seen++ == 0)
+      cboz_block_size = size;
+    else if (cboz_block_size != size)
+      cboz_block_size = 0;
   }
 
   if (scan->controller == node && scan->cpu) {
@@ -572,6 +611,8 @@ struct chosen_scan {
   const struct fdt_scan_node *chosen;
   void* kernel_start;
   void* kernel_end;
+  void* initrd_start;
+  void* initrd_end;
 };
 
 static void chosen_open(const struct fdt_scan_node *node, void *extra)
@@ -591,6 +632,15 @@ static int chosen_close(const struct fdt_scan_node *node, void *extra)
   return 0;
 }
 
+// The initrd bounds are one or two cells, whatever #address-cells says
+static uint64_t chosen_cells(const struct fdt_scan_prop *prop)
+{
+  uint64_t val = bswap(prop->value[0]);
+  if (prop->len == 8)
+    val = (val << 32) | bswap(prop->value[1]);
+  return val;
+}
+
 static void chosen_prop(const struct fdt_scan_prop *prop, void *extra)
 {
   struct chosen_scan *scan = (struct chosen_scan *)extra;
@@ -602,6 +652,10 @@ static void chosen_prop(const struct fdt_scan_prop *prop, void *extra)
   } else if (!strcmp(prop->name, "riscv,kernel-end")) {
     fdt_get_address(prop->node->parent, prop->value, &val);
     scan->kernel_end = (void*)(uintptr_t)val;
+  } else if (!strcmp(prop->name, "linux,initrd-start")) {
+    scan->initrd_start = (void*)(uintptr_t)chosen_cells(prop);
+  } else if (!strcmp(prop->name, "linux,initrd-end")) {
+    scan->initrd_end = (void*)(uintptr_t)chosen_cells(prop);
   }
 }
 
@@ -621,6 +675,8 @@ void query_chosen(uintptr_t fdt)
   fdt_scan(fdt, &cb);
   kernel_start = chosen.kernel_start;
   kernel_end = chosen.kernel_end;
+  initrd_start = chosen.initrd_start;
+  initrd_end = chosen.initrd_end;
 }
 
 //////////////////////////////////////////// HART FILTER ////////////////////////////////////////
@@ -667,6 +723,7 @@ static bool hart_filter_mask(const struct hart_filter *filter)
 #else
   if (!strcmp(filter->mmu_type, "riscv,sv39")) return false;
   if (!strcmp(filter->mmu_type, "riscv,sv48")) return false;
+  if (!strcmp(filter->mmu_type, "riscv,sv57")) return false;
 #endif
   printm("hart_filter_mask saw unknown hart type: status=\"%s\", mmu_type=\"%s\"\n",
          filter->status, filter->mmu_type);
@@ -76,6 +76,13 @@ extern uint64_t hart_mask;
 extern void* kernel_start;
 extern void* kernel_end;
 
+// Optional FDT preloaded initial ramdisk
+extern void* initrd_start;
+extern void* initrd_end;
+
+// The rate of the time CSR, from timebase-frequency; 0 if unknown
+extern uint64_t timebase_freq;
+
 #ifdef PK_PRINT_DEVICE_TREE
 // Prints the device tree to the console as a DTS
 void fdt_print(uintptr_t fdt);
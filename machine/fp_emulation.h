@@ -81,6 +81,11 @@
 #define SET_F32_RD(insn, regs, val) (SET_F32_REG(insn, 7, regs, val), SET_FS_DIRTY())
 #define SET_F64_RD(insn, regs, val) (SET_F64_REG(insn, 7, regs, val), SET_FS_DIRTY())
 
+DECLARE_EMULATION_FUNC(emulate_fp);
+DECLARE_EMULATION_FUNC(emulate_fmadd);
+DECLARE_EMULATION_FUNC(emulate_float_load);
+DECLARE_EMULATION_FUNC(emulate_float_store);
+
 #define GET_F32_RS2C(insn, regs) (GET_F32_REG(insn, 2, regs))
 #define GET_F32_RS2S(insn, regs) (GET_F32_REG(RVC_RS2S(insn), 0, regs))
 #define GET_F64_RS2C(insn, regs) (GET_F64_REG(insn, 2, regs))
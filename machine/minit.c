@@ -9,6 +9,7 @@
 #include "xuart.h"
 #include "uartlite.h"
 #include "uart16550.h"
+#include "sdhost.h"
 #include "finisher.h"
 #include "disabled_hart_mask.h"
 #include "htif.h"
@@ -20,8 +21,12 @@ uintptr_t mem_size;
 volatile uint64_t* mtime;
 volatile uint32_t* plic_priorities;
 size_t plic_ndevs;
+uint32_t cboz_block_size;
+uint64_t timebase_freq;
 void* kernel_start;
 void* kernel_end;
+void* initrd_start;
+void* initrd_end;
 
 static void mstatus_init()
 {
@@ -43,6 +48,14 @@ static void mstatus_init()
     write_csr(sptbr, 0);
 }
 
+static void envcfg_init()
+{
+  // M-mode may always use cbo.zero; let S-mode use it too
+  if (cboz_block_size)
+    // by number, for assemblers that don't know menvcfg
+    asm volatile ("csrs " STR(CSR_MENVCFG) ", %0" : : "r" (MENVCFG_CBZE));
+}
+
 // send S-mode interrupts and most exceptions straight to S-mode
 static void delegate_traps()
 {
@@ -107,6 +120,7 @@ static void memory_init()
 static void hart_init()
 {
   mstatus_init();
+  envcfg_init();
   //fp_init();
 #ifndef BBL_BOOT_MACHINE
   delegate_traps();
@@ -188,9 +202,11 @@ void init_first_hart(uintptr_t hartid, uintptr_t dtb)
 
   query_mem(dtb);
   query_harts(dtb);
+  envcfg_init(); // now that the harts' ISA strings are known
   query_clint(dtb);
   query_plic(dtb);
   query_chosen(dtb);
+  query_sdhost(dtb);
 
   wake_harts();
 
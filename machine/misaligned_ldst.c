@@ -71,8 +71,13 @@ void misaligned_load_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
   }
 
   val.int64 = 0;
-  for (intptr_t i = 0; i < len; i++)
-    val.bytes[i] = load_uint8_t((void *)(addr + i), mepc);
+#if __riscv_xlen == 32
+  if (len == 8)
+    val.int64 = load_misaligned(addr, 4, mepc)
+                | ((uint64_t)load_misaligned(addr + 4, 4, mepc) << 32);
+  else
+#endif
+    val.intx = load_misaligned(addr, len, mepc);
 
   if (!fp)
     SET_RD(insn, regs, (intptr_t)val.intx << shift >> shift);
@@ -138,8 +143,13 @@ void misaligned_store_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
   }
 
   uintptr_t addr = read_csr(mbadaddr);
-  for (int i = 0; i < len; i++)
-    store_uint8_t((void *)(addr + i), val.bytes[i], mepc);
+#if __riscv_xlen == 32
+  if (len == 8) {
+    store_misaligned(addr, val.int64, 4, mepc);
+    store_misaligned(addr + 4, val.int64 >> 32, 4, mepc);
+  } else
+#endif
+    store_misaligned(addr, val.intx, len, mepc);
 
   write_csr(mepc, npc);
 }
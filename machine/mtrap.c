@@ -23,7 +23,8 @@ void __attribute__((noreturn)) bad_trap(uintptr_t* regs, uintptr_t dummy, uintpt
   die("machine mode: unhandlable trap %d @ %p", read_csr(mcause), mepc);
 }
 
-static uintptr_t mcall_console_putchar(uint8_t ch)
+// Also called from the SBI fast path in mentry.S
+uintptr_t mcall_console_putchar(uint8_t ch)
 {
   if (uart) {
     uart_putchar(ch);
@@ -98,6 +99,8 @@ static uintptr_t mcall_shutdown()
 
 static uintptr_t mcall_set_timer(uint64_t when)
 {
+  _Static_assert(offsetof(hls_t, timecmp) + MENTRY_HLS_OFFSET == MENTRY_TIMECMP_OFFSET,
+                 "MENTRY_TIMECMP_OFFSET doesn't match hls_t");
   *HLS()->timecmp = when;
   clear_csr(mip, MIP_STIP);
   set_csr(mie, MIP_MTIP);
@@ -223,6 +226,18 @@ static void machine_page_fault(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc
       goto fail;
     }
 
+    // The misaligned fast path in mentry.S saved only a0-a7 and sp in the
+    // frame __redirect_trap restores from; the other registers were saved
+    // just now, in the frame below it.
+    extern char __misaligned_fast_path[], __misaligned_fast_path_end[];
+    if (mepc >= (uintptr_t)__misaligned_fast_path &&
+        mepc < (uintptr_t)__misaligned_fast_path_end) {
+      uintptr_t* frame = regs + INTEGER_CONTEXT_SIZE / REGBYTES;
+      for (int i = 1; i < 32; i++)
+        if (i != 2 && (i < 10 || i > 17))
+          frame[i] = regs[i];
+    }
+
     return redirect_trap(regs[12], regs[13], read_csr(mbadaddr));
   }
 
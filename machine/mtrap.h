@@ -35,6 +35,14 @@ extern uintptr_t mem_size;
 extern volatile uint64_t* mtime;
 extern volatile uint32_t* plic_priorities;
 extern size_t plic_ndevs;
+extern uint32_t cboz_block_size; // 0 unless every hart has Zicboz
+
+// cbo.zero (a0), spelled out for assemblers that predate Zicboz
+static inline void cbo_zero(uintptr_t addr)
+{
+  register uintptr_t a0 asm ("a0") = addr;
+  asm volatile (".word 0x0045200f" : : "r" (a0) : "memory");
+}
 
 typedef struct {
   volatile uint32_t* ipi;
@@ -90,6 +98,7 @@ static inline void wfi()
 #define MENTRY_FRAME_SIZE (MENTRY_HLS_OFFSET + HLS_SIZE)
 #define MENTRY_IPI_OFFSET (MENTRY_HLS_OFFSET)
 #define MENTRY_IPI_PENDING_OFFSET (MENTRY_HLS_OFFSET + REGBYTES)
+#define MENTRY_TIMECMP_OFFSET (MENTRY_HLS_OFFSET + 2 * REGBYTES)
 
 #ifdef __riscv_flen
 # define SOFT_FLOAT_CONTEXT_SIZE 0
@@ -4,38 +4,124 @@
 
 #ifndef __riscv_muldiv
 
-#if __riscv_xlen == 64
-typedef __int128 double_int;
-#else
-typedef int64_t double_int;
-#endif
+// Shift-and-add multiplication and shift-and-subtract division, rather
+// than libgcc's routines, which would go through the same traps again on
+// a core without M.  Loops run only as long as the operands have bits.
+
+#define XLEN (8 * sizeof(uintptr_t))
+
+// floor(log2(x)), for x != 0
+static inline int log2_floor(uintptr_t x)
+{
+  int n = 0;
+  for (int k = XLEN / 2; k > 0; k /= 2)
+    if (x >> k)
+      x >>= k, n += k;
+  return n;
+}
 
-// These routines rely on the compiler to turn these operations into libcalls
-// when not natively supported.  So work on making those go fast.
+// The low word of a * b, a shifted copy of a for each set bit of b
+static uintptr_t mul(uintptr_t a, uintptr_t b)
+{
+  uintptr_t lo = 0;
+  if (a < b)
+    a ^= b, b ^= a, a ^= b;
+  for ( ; b; b >>= 1, a <<= 1)
+    if (b & 1)
+      lo += a;
+  return lo;
+}
+
+// The high word of the unsigned product a * b
+static uintptr_t mulhu(uintptr_t a, uintptr_t b)
+{
+  uintptr_t lo = 0, hi = 0, a_hi = 0;
+  if (a < b)
+    a ^= b, b ^= a, a ^= b;
+  for ( ; b; b >>= 1) {
+    if (b & 1) {
+      uintptr_t sum = lo + a;
+      hi += a_hi + (sum < lo);
+      lo = sum;
+    }
+    a_hi = (a_hi << 1) | (a >> (XLEN - 1));
+    a <<= 1;
+  }
+  return hi;
+}
+
+// a / b, leaving a % b in *rem, with RISC-V's results when b == 0
+static uintptr_t divu(uintptr_t a, uintptr_t b, uintptr_t* rem)
+{
+  if (b == 0) {
+    *rem = a;
+    return -1;
+  }
+  if (a < b) {
+    *rem = a;
+    return 0;
+  }
+  if ((b & (b - 1)) == 0) {
+    *rem = a & (b - 1);
+    return a >> log2_floor(b);
+  }
+
+  // line up the divisor's top bit with the dividend's, then one quotient
+  // bit per step
+  int shift = log2_floor(a) - log2_floor(b);
+  uintptr_t q = 0;
+  b <<= shift;
+  for (int i = 0; i <= shift; i++, b >>= 1) {
+    q <<= 1;
+    if (a >= b) {
+      a -= b;
+      q |= 1;
+    }
+  }
+  *rem = a;
+  return q;
+}
+
+// Signed a / b and a % b.  The most negative a over -1 needs no special
+// case: its magnitude divides to itself, which negates to itself.
+static intptr_t div(intptr_t a, intptr_t b, intptr_t* rem)
+{
+  if (b == 0) {
+    *rem = a;
+    return -1;
+  }
+
+  uintptr_t ua = a < 0 ? -(uintptr_t)a : a, ub = b < 0 ? -(uintptr_t)b : b, ur;
+  uintptr_t q = divu(ua, ub, &ur);
+  *rem = a < 0 ? -ur : ur;
+  return (a < 0) != (b < 0) ? -q : q;
+}
 
 DECLARE_EMULATION_FUNC(emulate_mul_div)
 {
   uintptr_t rs1 = GET_RS1(insn, regs), rs2 = GET_RS2(insn, regs), val;
+  intptr_t srem;
+  uintptr_t urem;
 
-  if ((insn & MASK_MUL) == MATCH_MUL)
-    val = rs1 * rs2;
-  else if ((insn & MASK_DIV) == MATCH_DIV)
-    val = (intptr_t)rs1 / (intptr_t)rs2;
-  else if ((insn & MASK_DIVU) == MATCH_DIVU)
-    val = rs1 / rs2;
-  else if ((insn & MASK_REM) == MATCH_REM)
-    val = (intptr_t)rs1 % (intptr_t)rs2;
-  else if ((insn & MASK_REMU) == MATCH_REMU)
-    val = rs1 % rs2;
-  else if ((insn & MASK_MULH) == MATCH_MULH)
-    val = ((double_int)(intptr_t)rs1 * (double_int)(intptr_t)rs2) >> (8 * sizeof(rs1));
-  else if ((insn & MASK_MULHU) == MATCH_MULHU)
-    val = ((double_int)rs1 * (double_int)rs2) >> (8 * sizeof(rs1));
-  else if ((insn & MASK_MULHSU) == MATCH_MULHSU)
-    val = ((double_int)(intptr_t)rs1 * (double_int)rs2) >> (8 * sizeof(rs1));
-  else
+  if ((insn >> 25) != 1)
     return truly_illegal_insn(regs, mcause, mepc, mstatus, insn);
 
+  switch ((insn & MASK_FUNCT3) >> 12)
+  {
+    case 0: val = mul(rs1, rs2); break;
+    case 1: // MULH
+      val = mulhu(rs1, rs2) - ((intptr_t)rs1 < 0 ? rs2 : 0) - ((intptr_t)rs2 < 0 ? rs1 : 0);
+      break;
+    case 2: // MULHSU
+      val = mulhu(rs1, rs2) - ((intptr_t)rs1 < 0 ? rs2 : 0);
+      break;
+    case 3: val = mulhu(rs1, rs2); break;
+    case 4: val = div(rs1, rs2, &srem); break;
+    case 5: val = divu(rs1, rs2, &urem); break;
+    case 6: div(rs1, rs2, &srem); val = srem; break;
+    default: divu(rs1, rs2, &urem); val = urem; break;
+  }
+
   SET_RD(insn, regs, val);
 }
 
@@ -45,20 +131,22 @@ DECLARE_EMULATION_FUNC(emulate_mul_div32)
 {
   uint32_t rs1 = GET_RS1(insn, regs), rs2 = GET_RS2(insn, regs);
   int32_t val;
+  intptr_t srem;
+  uintptr_t urem;
 
-  if ((insn & MASK_MULW) == MATCH_MULW)
-    val = rs1 * rs2;
-  else if ((insn & MASK_DIVW) == MATCH_DIVW)
-    val = (int32_t)rs1 / (int32_t)rs2;
-  else if ((insn & MASK_DIVUW) == MATCH_DIVUW)
-    val = rs1 / rs2;
-  else if ((insn & MASK_REMW) == MATCH_REMW)
-    val = (int32_t)rs1 % (int32_t)rs2;
-  else if ((insn & MASK_REMUW) == MATCH_REMUW)
-    val = rs1 % rs2;
-  else
+  if ((insn >> 25) != 1)
     return truly_illegal_insn(regs, mcause, mepc, mstatus, insn);
 
+  switch ((insn & MASK_FUNCT3) >> 12)
+  {
+    case 0: val = mul(rs1, rs2); break;
+    case 4: val = div((int32_t)rs1, (int32_t)rs2, &srem); break;
+    case 5: val = divu(rs1, rs2, &urem); break;
+    case 6: div((int32_t)rs1, (int32_t)rs2, &srem); val = srem; break;
+    case 7: divu(rs1, rs2, &urem); val = urem; break;
+    default: return truly_illegal_insn(regs, mcause, mepc, mstatus, insn);
+  }
+
   SET_RD(insn, regs, val);
 }
 
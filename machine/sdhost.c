@@ -0,0 +1,192 @@
+#include "sdhost.h"
+#include <string.h>
+#include "fdt.h"
+#include "bits.h"
+
+// A polled driver for the nemu-sdhost MMC controller, whose registers
+// follow the BCM2835 SD host's.  Data is moved through the FIFO by the
+// CPU; reads of any length are a single CMD18 transfer.
+
+volatile uint32_t* sdhost;
+
+#define SDCMD   0x00 // command and flags
+#define SDARG   0x04 // command argument
+#define SDRSP0  0x10 // response, or its low word
+#define SDHSTS  0x20 // status
+#define SDVDD   0x30 // power
+#define SDEDM   0x34 // emergency debug mode; holds the FIFO level
+#define SDHCFG  0x38 // host configuration
+#define SDHBCT  0x3c // block size
+#define SDDATA  0x40 // data FIFO
+#define SDHBLC  0x50 // block count
+
+#define SD_REG(off) sdhost[(off) / sizeof(uint32_t)]
+
+#define SDCMD_NEW_FLAG      0x8000
+#define SDCMD_FAIL_FLAG     0x4000
+#define SDCMD_BUSYWAIT      0x0800
+#define SDCMD_NO_RESPONSE   0x0400
+#define SDCMD_LONG_RESPONSE 0x0200
+#define SDCMD_READ_CMD      0x0040
+
+#define SDHSTS_CLEAR_MASK   0x07f8
+#define SDHSTS_ERROR_MASK   0x00f8
+#define SDHSTS_CRC7_ERROR   0x0010
+
+#define SDHCFG_WIDE_INT_BUS 0x0002
+
+#define SDEDM_FIFO_LEVEL(edm) (((edm) >> 4) & 0x1f)
+
+#define MMC_GO_IDLE_STATE         0
+#define MMC_SEND_OP_COND          1
+#define MMC_ALL_SEND_CID          2
+#define MMC_SET_RELATIVE_ADDR     3
+#define MMC_SELECT_CARD           7
+#define MMC_STOP_TRANSMISSION     12
+#define MMC_READ_MULTIPLE_BLOCK   18
+
+#define OCR_BUSY          0x80000000 // clear while the card powers up
+#define OCR_HCS           0x40000000 // sector-addressed (high capacity)
+#define OCR_VOLTAGES      0x00ff8000
+
+#define SDHOST_RCA        1
+#define SDHOST_SPINS      1000000
+#define SDHOST_MAX_BLOCKS 0xffff // per transfer
+
+static int sector_addressed;
+
+static int sdhost_cmd(uint32_t cmd, uint32_t arg, uint32_t flags)
+{
+  SD_REG(SDHSTS) = SDHSTS_CLEAR_MASK;
+  SD_REG(SDARG) = arg;
+  SD_REG(SDCMD) = cmd | flags | SDCMD_NEW_FLAG;
+
+  for (long spins = SDHOST_SPINS; SD_REG(SDCMD) & SDCMD_NEW_FLAG; )
+    if (--spins == 0)
+      return -1;
+
+  // R3, the reply to SEND_OP_COND, has no CRC, so a CRC7 error is noise
+  uint32_t errors = SDHSTS_ERROR_MASK;
+  if (cmd == MMC_SEND_OP_COND)
+    errors &= ~SDHSTS_CRC7_ERROR;
+  if (SD_REG(SDHSTS) & errors)
+    return -1;
+  if ((SD_REG(SDCMD) & SDCMD_FAIL_FLAG) && errors == SDHSTS_ERROR_MASK)
+    return -1;
+  return 0;
+}
+
+// Bring the card from idle to the transfer state.  Returns 0, or -1 if
+// there's no card or it won't respond.
+int sdhost_init()
+{
+  SD_REG(SDVDD) = 1;
+  SD_REG(SDHCFG) = SDHCFG_WIDE_INT_BUS;
+  SD_REG(SDHBCT) = SDHOST_BLOCK_SIZE;
+
+  if (sdhost_cmd(MMC_GO_IDLE_STATE, 0, SDCMD_NO_RESPONSE) != 0)
+    return -1;
+
+  uint32_t ocr = 0;
+  for (long tries = SDHOST_SPINS; !(ocr & OCR_BUSY); )
+  {
+    if (sdhost_cmd(MMC_SEND_OP_COND, OCR_HCS | OCR_VOLTAGES, 0) != 0 || --tries == 0)
+      return -1;
+    ocr = SD_REG(SDRSP0);
+  }
+  sector_addressed = (ocr & OCR_HCS) != 0;
+
+  if (sdhost_cmd(MMC_ALL_SEND_CID, 0, SDCMD_LONG_RESPONSE) != 0 ||
+      sdhost_cmd(MMC_SET_RELATIVE_ADDR, SDHOST_RCA << 16, 0) != 0 ||
+      sdhost_cmd(MMC_SELECT_CARD, SDHOST_RCA << 16, SDCMD_BUSYWAIT) != 0)
+    return -1;
+
+  return 0;
+}
+
+// Read nblocks blocks from block on into buf, which must be word-aligned.
+// Returns 0, or -1 on a device error.
+int sdhost_read(uint64_t block, void* buf, size_t nblocks)
+{
+  uint32_t* p = buf;
+
+  while (nblocks > 0)
+  {
+    size_t n = MIN(nblocks, SDHOST_MAX_BLOCKS);
+    uint64_t addr = sector_addressed ? block : block * SDHOST_BLOCK_SIZE;
+
+    SD_REG(SDHBCT) = SDHOST_BLOCK_SIZE;
+    SD_REG(SDHBLC) = n;
+    if (sdhost_cmd(MMC_READ_MULTIPLE_BLOCK, addr, SDCMD_READ_CMD) != 0)
+      return -1;
+
+    // drain the FIFO as it fills, as many words at a time as it holds
+    size_t words = n * (SDHOST_BLOCK_SIZE / sizeof(uint32_t));
+    for (long spins = SDHOST_SPINS; words > 0; )
+    {
+      uint32_t level = SDEDM_FIFO_LEVEL(SD_REG(SDEDM));
+      if (level == 0)
+      {
+        if ((SD_REG(SDHSTS) & SDHSTS_ERROR_MASK) || --spins == 0)
+          return -1;
+        continue;
+      }
+
+      for (level = MIN(level, words); level > 0; level--, words--)
+        *p++ = SD_REG(SDDATA);
+      spins = SDHOST_SPINS;
+    }
+
+    if (sdhost_cmd(MMC_STOP_TRANSMISSION, 0, SDCMD_BUSYWAIT) != 0)
+      return -1;
+
+    block += n;
+    nblocks -= n;
+  }
+
+  return 0;
+}
+
+struct sdhost_scan
+{
+  int compat;
+  uint64_t reg;
+};
+
+static void sdhost_open(const struct fdt_scan_node *node, void *extra)
+{
+  struct sdhost_scan *scan = (struct sdhost_scan *)extra;
+  memset(scan, 0, sizeof(*scan));
+}
+
+static void sdhost_prop(const struct fdt_scan_prop *prop, void *extra)
+{
+  struct sdhost_scan *scan = (struct sdhost_scan *)extra;
+  if (!strcmp(prop->name, "compatible") && !strcmp((const char*)prop->value, "nemu-sdhost")) {
+    scan->compat = 1;
+  } else if (!strcmp(prop->name, "reg")) {
+    fdt_get_address(prop->node->parent, prop->value, &scan->reg);
+  }
+}
+
+static void sdhost_done(const struct fdt_scan_node *node, void *extra)
+{
+  struct sdhost_scan *scan = (struct sdhost_scan *)extra;
+  if (!scan->compat || !scan->reg || sdhost) return;
+
+  sdhost = (void*)(uintptr_t)scan->reg;
+}
+
+void query_sdhost(uintptr_t fdt)
+{
+  struct fdt_cb cb;
+  struct sdhost_scan scan;
+
+  memset(&cb, 0, sizeof(cb));
+  cb.open = sdhost_open;
+  cb.prop = sdhost_prop;
+  cb.done = sdhost_done;
+  cb.extra = &scan;
+
+  fdt_scan(fdt, &cb);
+}
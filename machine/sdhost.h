@@ -0,0 +1,15 @@
+#ifndef _RISCV_SDHOST_H
+#define _RISCV_SDHOST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SDHOST_BLOCK_SIZE 512
+
+extern volatile uint32_t* sdhost;
+
+void query_sdhost(uintptr_t dtb);
+int sdhost_init();
+int sdhost_read(uint64_t block, void* buf, size_t nblocks);
+
+#endif
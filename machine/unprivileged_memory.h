@@ -66,6 +66,72 @@ static inline void store_uint64_t(uint64_t* addr, uint64_t val, uintptr_t mepc)
 }
 #endif
 
+// Misaligned accesses of up to XLEN bits, each in a single MPRV window.  A
+// load within a page reads the one or two aligned words it overlaps and
+// shifts the halves together; one that crosses a page goes a byte at a
+// time, so a fault is reported against the page that caused it.  Stores
+// always go a byte at a time, so that bytes outside [addr, addr + len)
+// are never rewritten under another hart.
+static inline uintptr_t load_misaligned(uintptr_t addr, int len, uintptr_t mepc)
+{
+  register uintptr_t __mstatus_adjust asm ("a1") = MSTATUS_MPRV;
+  register uintptr_t __mepc asm ("a2") = mepc;
+  register uintptr_t __mstatus asm ("a3");
+  uintptr_t end = addr + len, val, tmp;
+
+  if (((addr ^ (end - 1)) >> RISCV_PGSHIFT) == 0) {
+    uintptr_t lo = addr & -sizeof(uintptr_t);
+    uintptr_t hi = (end - 1) & -sizeof(uintptr_t);
+    asm volatile ("csrrs %[mstatus], mstatus, %[mprv]\n"
+                  STR(LOAD) " %[val], (%[lo])\n"
+                  STR(LOAD) " %[tmp], (%[hi])\n"
+                  "csrw mstatus, %[mstatus]"
+                  : [mstatus] "+&r" (__mstatus), [val] "=&r" (val), [tmp] "=&r" (tmp)
+                  : [mprv] "r" (__mstatus_adjust), [mepc] "r" (__mepc),
+                    [lo] "r" (lo), [hi] "r" (hi)
+                  : "memory");
+    int shift = 8 * (addr & (sizeof(uintptr_t) - 1));
+    if (shift)
+      val = (val >> shift) | (tmp << (8 * sizeof(uintptr_t) - shift));
+    if (len < sizeof(uintptr_t))
+      val &= ((uintptr_t)1 << (8 * len)) - 1;
+  } else {
+    val = 0;
+    asm volatile ("csrrs %[mstatus], mstatus, %[mprv]\n"
+                  "1: addi %[end], %[end], -1\n"
+                  "lbu %[tmp], (%[end])\n"
+                  "slli %[val], %[val], 8\n"
+                  "or %[val], %[val], %[tmp]\n"
+                  "bne %[end], %[addr], 1b\n"
+                  "csrw mstatus, %[mstatus]"
+                  : [mstatus] "+&r" (__mstatus), [val] "+&r" (val), [tmp] "=&r" (tmp),
+                    [end] "+&r" (end)
+                  : [mprv] "r" (__mstatus_adjust), [mepc] "r" (__mepc),
+                    [addr] "r" (addr)
+                  : "memory");
+  }
+  return val;
+}
+
+static inline void store_misaligned(uintptr_t addr, uintptr_t val, int len, uintptr_t mepc)
+{
+  register uintptr_t __mstatus_adjust asm ("a1") = MSTATUS_MPRV;
+  register uintptr_t __mepc asm ("a2") = mepc;
+  register uintptr_t __mstatus asm ("a3");
+  uintptr_t end = addr + len;
+
+  asm volatile ("csrrs %[mstatus], mstatus, %[mprv]\n"
+                "1: sb %[val], (%[addr])\n"
+                "srli %[val], %[val], 8\n"
+                "addi %[addr], %[addr], 1\n"
+                "bne %[addr], %[end], 1b\n"
+                "csrw mstatus, %[mstatus]"
+                : [mstatus] "+&r" (__mstatus), [val] "+&r" (val), [addr] "+&r" (addr)
+                : [mprv] "r" (__mstatus_adjust), [mepc] "r" (__mepc),
+                  [end] "r" (end)
+                : "memory");
+}
+
 static uintptr_t __attribute__((always_inline)) get_insn(uintptr_t mepc, uintptr_t* mstatus)
 {
   register uintptr_t __mstatus_adjust asm ("a1") = MSTATUS_MPRV | MSTATUS_MXR;
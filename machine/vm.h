@@ -8,12 +8,10 @@
 
 #define MEGAPAGE_SIZE ((uintptr_t)(RISCV_PGSIZE << RISCV_PGLEVEL_BITS))
 #if __riscv_xlen == 64
-# define SATP_MODE_CHOICE INSERT_FIELD(0, SATP64_MODE, SATP_MODE_SV39)
-# define VA_BITS 39
+# define SATP_MODE_DEFAULT SATP_MODE_SV39
 # define GIGAPAGE_SIZE (MEGAPAGE_SIZE << RISCV_PGLEVEL_BITS)
 #else
-# define SATP_MODE_CHOICE INSERT_FIELD(0, SATP32_MODE, SATP_MODE_SV32)
-# define VA_BITS 32
+# define SATP_MODE_DEFAULT SATP_MODE_SV32
 #endif
 
 typedef uintptr_t pte_t;
@@ -21,7 +19,26 @@ extern pte_t* root_page_table;
 
 static inline void flush_tlb()
 {
-  asm volatile ("sfence.vma");
+  asm volatile ("sfence.vma" : : : "memory");
+}
+
+// Flush every non-global translation tagged with asid
+static inline void flush_tlb_asid(uintptr_t asid)
+{
+  asm volatile ("sfence.vma zero, %0" : : "r" (asid) : "memory");
+}
+
+// Flush the non-global translation of va tagged with asid
+static inline void flush_tlb_page(uintptr_t va, uintptr_t asid)
+{
+  asm volatile ("sfence.vma %0, %1" : : "r" (va), "r" (asid) : "memory");
+}
+
+// Page-table levels walked in a satp mode: Sv32 has two, and Sv39, Sv48
+// and Sv57 have three, four and five.
+static inline int satp_mode_levels(uintptr_t mode)
+{
+  return mode == SATP_MODE_SV32 ? 2 : mode - SATP_MODE_SV39 + 3;
 }
 
 static inline pte_t pte_create(uintptr_t ppn, int type)
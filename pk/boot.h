@@ -15,9 +15,9 @@ typedef struct {
   size_t phdr_size;
   size_t bias;
   size_t entry;
+  size_t load_end; // end of the loaded segments
   size_t brk_min;
   size_t brk;
-  size_t brk_max;
   size_t mmap_max;
   size_t stack_top;
   uint64_t time0;
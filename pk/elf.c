@@ -23,14 +23,66 @@ static inline int get_prot(uint32_t p_flags)
   return (prot_x | prot_w | prot_r);
 }
 
+/**
+ * The program is read through the host, unless an image of it was
+ * preloaded into memory; that is mapped read-only at window meanwhile.
+ */
+static ssize_t elf_pread(file_t* file, uintptr_t window, void* buf, size_t size, off_t offset)
+{
+  if (file)
+    return file_pread(file, buf, size, offset);
+
+  size_t image_size = image_end - image_start;
+  if (offset >= image_size)
+    return 0;
+  size = MIN(size, image_size - offset);
+  memcpy(buf, (void*)window + offset, size);
+  return size;
+}
+
+/**
+ * Read-only segments whose pages line up with the image's, and that have
+ * no BSS to clear, share the image's pages.  Anything else is copied.
+ */
+static int load_image_segment(Elf_Phdr* ph, uintptr_t vaddr, int prot, uintptr_t window)
+{
+  uintptr_t prepad = vaddr % RISCV_PGSIZE;
+  uintptr_t paddr = image_start + ph->p_offset - prepad;
+  if (ph->p_offset + ph->p_filesz > image_end - image_start)
+    return -1;
+
+  if (!(prot & PROT_WRITE) && !(paddr % RISCV_PGSIZE) && ph->p_memsz == ph->p_filesz)
+    return map_image(vaddr - prepad, paddr, ph->p_filesz + prepad, prot) == vaddr - prepad ? 0 : -1;
+
+  size_t len = ph->p_memsz + prepad;
+  if (__do_mmap(vaddr - prepad, len, prot | PROT_WRITE, MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS, 0, 0) != vaddr - prepad)
+    return -1;
+  memcpy((void*)vaddr, (void*)window + ph->p_offset, ph->p_filesz);
+  if (!(prot & PROT_WRITE))
+    if (do_mprotect(vaddr - prepad, len, prot))
+      return -1;
+  return 0;
+}
+
 void load_elf(const char* fn, elf_info* info)
 {
-  file_t* file = file_open(fn, O_RDONLY, 0);
-  if (IS_ERR_VALUE(file))
-    goto fail;
+  file_t* file = NULL;
+  uintptr_t window = 0, window_base = 0;
+  size_t window_size = 0;
+  if (image_end > image_start) {
+    window_size = image_end - ROUNDDOWN(image_start, RISCV_PGSIZE);
+    window_base = map_image(0, ROUNDDOWN(image_start, RISCV_PGSIZE), window_size, PROT_READ);
+    if (window_base == (uintptr_t)-1)
+      goto fail;
+    window = window_base + image_start % RISCV_PGSIZE;
+  } else {
+    file = file_open(fn, O_RDONLY, 0);
+    if (IS_ERR_VALUE(file))
+      goto fail;
+  }
 
   Elf_Ehdr eh;
-  ssize_t ehdr_size = file_pread(file, &eh, sizeof(eh), 0);
+  ssize_t ehdr_size = elf_pread(file, window, &eh, sizeof(eh), 0);
   if (ehdr_size < (ssize_t)sizeof(eh) ||
       !(eh.e_ident[0] == '\177' && eh.e_ident[1] == 'E' &&
         eh.e_ident[2] == 'L'    && eh.e_ident[3] == 'F'))
@@ -49,7 +101,7 @@ void load_elf(const char* fn, elf_info* info)
   size_t phdr_size = eh.e_phnum * sizeof(Elf_Phdr);
   if (phdr_size > info->phdr_size)
     goto fail;
-  ssize_t ret = file_pread(file, (void*)info->phdr, phdr_size, eh.e_phoff);
+  ssize_t ret = elf_pread(file, window, (void*)info->phdr, phdr_size, eh.e_phoff);
   if (ret < (ssize_t)phdr_size)
     goto fail;
   info->phnum = eh.e_phnum;
@@ -79,10 +131,15 @@ void load_elf(const char* fn, elf_info* info)
       uintptr_t vaddr = ph[i].p_vaddr + bias;
       if (vaddr + ph[i].p_memsz > info->brk_min)
         info->brk_min = vaddr + ph[i].p_memsz;
-      int flags2 = flags | (prepad ? MAP_POPULATE : 0);
       int prot = get_prot(ph[i].p_flags);
-      if (__do_mmap(vaddr - prepad, ph[i].p_filesz + prepad, prot | PROT_WRITE, flags2, file, ph[i].p_offset - prepad) != vaddr - prepad)
+      if (!file) {
+        if (load_image_segment(&ph[i], vaddr, prot, window) != 0)
+          goto fail;
+        continue;
+      }
+      if (__do_mmap(vaddr - prepad, ph[i].p_filesz + prepad, prot | PROT_WRITE, flags, file, ph[i].p_offset - prepad) != vaddr - prepad)
         goto fail;
+      // under demand paging, this faults in just the first page
       memset((void*)vaddr - prepad, 0, prepad);
       if (!(prot & PROT_WRITE))
         if (do_mprotect(vaddr - prepad, ph[i].p_filesz + prepad, prot))
@@ -94,7 +151,17 @@ void load_elf(const char* fn, elf_info* info)
     }
   }
 
-  file_decref(file);
+  info->load_end = info->brk_min;
+
+  // if the address space goes past pk, start the heap there, so brk
+  // isn't stopped short at DRAM_BASE
+  if (info->mmap_max > first_free_paddr && info->brk_min <= DRAM_BASE)
+    info->brk_min = first_free_paddr;
+
+  if (file)
+    file_decref(file);
+  else
+    do_munmap(window_base, window_size);
   return;
 
 fail:
@@ -36,6 +36,7 @@
 #define AT_ENTRY  9
 #define AT_SECURE 23
 #define AT_RANDOM 25
+#define AT_SYSINFO_EHDR 33
 
 #define PF_X 1
 #define PF_W 2
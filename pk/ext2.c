@@ -0,0 +1,508 @@
+// See LICENSE for license details.
+
+#include "file.h"
+#include "mmap.h"
+#include "pk.h"
+#include "bits.h"
+#include "sdhost.h"
+#include <string.h>
+#include <errno.h>
+
+// A read-only reader for the ext2 family on the SD card: ext2, ext3 and
+// ext4 images, as long as they use none of the incompatible features
+// outside EXT2_SUPPORTED below.  Metadata goes through a small block
+// cache; file data is read straight into the caller's buffer, as one
+// multi-block transfer per contiguous run of blocks.
+
+#define SECTOR_SIZE SDHOST_BLOCK_SIZE
+
+#define EXT2_SUPER_OFFSET 1024
+#define EXT2_MAGIC 0xef53
+#define EXT2_ROOT_INO 2
+
+// superblock fields
+#define SB_FIRST_DATA_BLOCK 20
+#define SB_LOG_BLOCK_SIZE 24
+#define SB_INODES_PER_GROUP 40
+#define SB_MAGIC 56
+#define SB_REV_LEVEL 76
+#define SB_INODE_SIZE 88
+#define SB_FEATURE_INCOMPAT 96
+#define SB_DESC_SIZE 254
+
+#define INCOMPAT_FILETYPE 0x0002
+#define INCOMPAT_EXTENTS 0x0040
+#define INCOMPAT_64BIT 0x0080
+#define INCOMPAT_MMP 0x0100
+#define INCOMPAT_FLEX_BG 0x0200
+#define INCOMPAT_EA_INODE 0x0400
+#define INCOMPAT_CSUM_SEED 0x2000
+#define INCOMPAT_LARGEDIR 0x4000
+#define EXT2_SUPPORTED (INCOMPAT_FILETYPE | INCOMPAT_EXTENTS | INCOMPAT_64BIT | \
+                        INCOMPAT_MMP | INCOMPAT_FLEX_BG | INCOMPAT_EA_INODE | \
+                        INCOMPAT_CSUM_SEED | INCOMPAT_LARGEDIR)
+
+// group descriptor fields
+#define BG_INODE_TABLE_LO 8
+#define BG_INODE_TABLE_HI 40
+
+// inode fields
+#define I_MODE 0
+#define I_UID 2
+#define I_SIZE_LO 4
+#define I_ATIME 8
+#define I_CTIME 12
+#define I_MTIME 16
+#define I_GID 24
+#define I_LINKS_COUNT 26
+#define I_BLOCKS_LO 28
+#define I_FLAGS 32
+#define I_BLOCK 40
+#define I_SIZE_HIGH 108
+#define I_NBLOCKS 15 // 12 direct, then single, double and triple indirect
+
+#define EXT4_EXTENTS_FL 0x80000
+#define EXT4_EXT_MAGIC 0xf30a
+#define EXT4_EXT_INIT_MAX_LEN 32768 // longer extents are uninitialized
+
+#define CACHE_SLOTS 16 // metadata blocks
+#define NODE_BUCKETS 64
+
+struct fs_node
+{
+  struct fs_node* next; // in its hash bucket
+  uint32_t ino;
+  uint32_t mode;
+  uint32_t flags;
+  uint32_t nlink, uid, gid;
+  uint32_t atime, mtime, ctime;
+  uint64_t size;
+  uint64_t blocks; // in sectors
+  uint32_t block[I_NBLOCKS];
+};
+
+static struct {
+  uint64_t start; // first sector of the filesystem
+  size_t block_size;
+  size_t sectors_per_block;
+  uint32_t first_data_block;
+  uint32_t inodes_per_group;
+  size_t inode_size;
+  size_t desc_size;
+} fs;
+
+static char* cache;
+static uint64_t cache_tag[CACHE_SLOTS];
+static char* bounce;
+static struct fs_node* node_hash[NODE_BUCKETS];
+static struct fs_node* free_nodes;
+static size_t nfree_nodes;
+
+static uint16_t get16(const void* p, size_t off)
+{
+  uint16_t v;
+  memcpy(&v, (const char*)p + off, sizeof(v));
+  return v;
+}
+
+static uint32_t get32(const void* p, size_t off)
+{
+  uint32_t v;
+  memcpy(&v, (const char*)p + off, sizeof(v));
+  return v;
+}
+
+static int dev_read(uint64_t block, size_t nblocks, void* buf)
+{
+  if (sdhost_read(fs.start + block * fs.sectors_per_block, buf,
+                  nblocks * fs.sectors_per_block) != 0)
+    return -EIO;
+  return 0;
+}
+
+// A metadata block, through the cache, or NULL if it can't be read
+static const char* read_meta(uint64_t block)
+{
+  size_t slot = block % CACHE_SLOTS;
+  char* buf = cache + slot * fs.block_size;
+  if (cache_tag[slot] != block + 1)
+  {
+    cache_tag[slot] = 0;
+    if (dev_read(block, 1, buf) != 0)
+      return NULL;
+    cache_tag[slot] = block + 1;
+  }
+  return buf;
+}
+
+// The physical block holding logical block lblock of n (0 for a hole), and
+// in *run how many blocks from there on are contiguous on the device, or
+// are all holes.  Returns 0, or -EIO.
+static int bmap_extents(struct fs_node* n, uint64_t lblock, uint64_t* pblock, uint64_t* run)
+{
+  const char* h = (const char*)n->block;
+  for (int depth = 0; ; depth++)
+  {
+    if (get16(h, 0) != EXT4_EXT_MAGIC || depth > 5)
+      return -EIO;
+
+    uint16_t entries = get16(h, 2);
+    const char* e = h + 12;
+    if (get16(h, 6) == 0)
+    {
+      // a leaf: find the extent holding lblock, or the hole before the next
+      for (uint16_t i = 0; i < entries; i++, e += 12)
+      {
+        uint32_t first = get32(e, 0);
+        uint32_t len = get16(e, 4);
+        int uninit = len > EXT4_EXT_INIT_MAX_LEN;
+        if (uninit)
+          len -= EXT4_EXT_INIT_MAX_LEN;
+
+        if (lblock < first)
+        {
+          *pblock = 0;
+          *run = first - lblock;
+          return 0;
+        }
+        if (lblock < (uint64_t)first + len)
+        {
+          uint64_t start = ((uint64_t)get16(e, 6) << 32) | get32(e, 8);
+          *pblock = uninit ? 0 : start + (lblock - first);
+          *run = first + len - lblock;
+          return 0;
+        }
+      }
+      *pblock = 0;
+      *run = 1;
+      return 0;
+    }
+
+    // an index: descend into the last subtree starting at or before lblock
+    const char* child = NULL;
+    for (uint16_t i = 0; i < entries && get32(e, 0) <= lblock; i++, e += 12)
+      child = e;
+    if (!child)
+    {
+      *pblock = 0;
+      *run = entries ? get32(h + 12, 0) - lblock : 1;
+      return 0;
+    }
+    uint64_t leaf = ((uint64_t)get16(child, 8) << 32) | get32(child, 4);
+    if (!(h = read_meta(leaf)))
+      return -EIO;
+  }
+}
+
+// The same for a classic ext2 block map, one entry at a time
+static int bmap_indirect(struct fs_node* n, uint64_t lblock, uint64_t* pblock)
+{
+  size_t per_block = fs.block_size / sizeof(uint32_t);
+  uint32_t b;
+  int levels;
+
+  if (lblock < 12) {
+    *pblock = n->block[lblock];
+    return 0;
+  }
+  lblock -= 12;
+  if (lblock < per_block) {
+    b = n->block[12], levels = 1;
+  } else if ((lblock -= per_block) < per_block * per_block) {
+    b = n->block[13], levels = 2;
+  } else {
+    lblock -= per_block * per_block;
+    b = n->block[14], levels = 3;
+  }
+
+  for ( ; levels > 0 && b != 0; levels--)
+  {
+    const char* ind = read_meta(b);
+    if (!ind)
+      return -EIO;
+    uint64_t span = 1;
+    for (int i = 1; i < levels; i++)
+      span *= per_block;
+    b = get32(ind, (lblock / span) * sizeof(uint32_t));
+    lblock %= span;
+  }
+
+  *pblock = b;
+  return 0;
+}
+
+#define MAX_RUN 256 // blocks probed ahead in a block map
+
+static int bmap(struct fs_node* n, uint64_t lblock, uint64_t* pblock, uint64_t* run)
+{
+  if (n->flags & EXT4_EXTENTS_FL)
+    return bmap_extents(n, lblock, pblock, run);
+
+  int ret = bmap_indirect(n, lblock, pblock);
+  if (ret != 0)
+    return ret;
+
+  for (*run = 1; *run < MAX_RUN; ++*run)
+  {
+    uint64_t next;
+    if (bmap_indirect(n, lblock + *run, &next) != 0 ||
+        next != (*pblock ? *pblock + *run : 0))
+      break;
+  }
+  return 0;
+}
+
+static struct fs_node* get_node(uint32_t ino)
+{
+  for (struct fs_node* n = node_hash[ino % NODE_BUCKETS]; n; n = n->next)
+    if (n->ino == ino)
+      return n;
+
+  if (ino == 0)
+    return NULL;
+
+  uint32_t group = (ino - 1) / fs.inodes_per_group;
+  uint32_t index = (ino - 1) % fs.inodes_per_group;
+  uint64_t desc = (uint64_t)group * fs.desc_size;
+  const char* gd = read_meta(fs.first_data_block + 1 + desc / fs.block_size);
+  if (!gd)
+    return NULL;
+  gd += desc % fs.block_size;
+  uint64_t table = get32(gd, BG_INODE_TABLE_LO);
+  if (fs.desc_size >= 64)
+    table |= (uint64_t)get32(gd, BG_INODE_TABLE_HI) << 32;
+
+  uint64_t off = (uint64_t)index * fs.inode_size;
+  const char* inode = read_meta(table + off / fs.block_size);
+  if (!inode)
+    return NULL;
+  inode += off % fs.block_size;
+
+  if (nfree_nodes == 0)
+  {
+    if (!(free_nodes = (struct fs_node*)kernel_page_alloc(1)))
+      return NULL;
+    nfree_nodes = RISCV_PGSIZE / sizeof(struct fs_node);
+  }
+  struct fs_node* n = free_nodes++;
+  nfree_nodes--;
+
+  n->ino = ino;
+  n->mode = get16(inode, I_MODE);
+  n->uid = get16(inode, I_UID);
+  n->gid = get16(inode, I_GID);
+  n->size = get32(inode, I_SIZE_LO) | ((uint64_t)get32(inode, I_SIZE_HIGH) << 32);
+  n->atime = get32(inode, I_ATIME);
+  n->ctime = get32(inode, I_CTIME);
+  n->mtime = get32(inode, I_MTIME);
+  n->nlink = get16(inode, I_LINKS_COUNT);
+  n->blocks = get32(inode, I_BLOCKS_LO);
+  n->flags = get32(inode, I_FLAGS);
+  memcpy(n->block, inode + I_BLOCK, sizeof(n->block));
+
+  n->next = node_hash[ino % NODE_BUCKETS];
+  node_hash[ino % NODE_BUCKETS] = n;
+  return n;
+}
+
+// The inode number of name in directory dir, or 0
+static uint32_t dir_find(struct fs_node* dir, const char* name, size_t len)
+{
+  for (uint64_t lblock = 0; lblock * fs.block_size < dir->size; lblock++)
+  {
+    uint64_t pblock, run;
+    const char* b;
+    if (bmap(dir, lblock, &pblock, &run) != 0 || !pblock || !(b = read_meta(pblock)))
+      continue;
+
+    for (size_t off = 0; off + 8 <= fs.block_size; )
+    {
+      const char* d = b + off;
+      uint16_t rec_len = get16(d, 4);
+      size_t name_len = (unsigned char)d[6];
+      if (rec_len < 8 || off + rec_len > fs.block_size)
+        break;
+      if (get32(d, 0) && name_len == len && memcmp(d + 8, name, len) == 0)
+        return get32(d, 0);
+      off += rec_len;
+    }
+  }
+  return 0;
+}
+
+static fs_node_t* ext2_lookup(const char* path)
+{
+  struct fs_node* n = get_node(EXT2_ROOT_INO);
+  while (n && *path)
+  {
+    const char* end = path;
+    while (*end && *end != '/')
+      end++;
+
+    size_t len = end - path;
+    if (len > 0 && !(len == 1 && path[0] == '.'))
+      n = S_ISDIR(n->mode) ? get_node(dir_find(n, path, len)) : NULL;
+
+    path = *end ? end + 1 : end;
+  }
+  return n;
+}
+
+static ssize_t ext2_pread(fs_node_t* n, void* buf, size_t len, off_t off)
+{
+  if (S_ISDIR(n->mode))
+    return -EISDIR;
+  if (off < 0)
+    return -EINVAL;
+  if (off >= n->size)
+    return 0;
+  len = MIN(len, n->size - off);
+
+  // a short symlink keeps its target in place of the block map
+  if (S_ISLNK(n->mode) && n->size < sizeof(n->block) && !(n->flags & EXT4_EXTENTS_FL))
+  {
+    memcpy(buf, (char*)n->block + off, len);
+    return len;
+  }
+
+  size_t done = 0;
+  while (done < len)
+  {
+    uint64_t pos = off + done;
+    uint64_t lblock = pos / fs.block_size;
+    size_t boff = pos % fs.block_size;
+    char* dst = (char*)buf + done;
+    uint64_t pblock, run;
+    if (bmap(n, lblock, &pblock, &run) != 0)
+      return done ? done : -EIO;
+
+    size_t nblocks = MIN(run, (len - done) / fs.block_size);
+    if (boff == 0 && nblocks > 0 && ((uintptr_t)dst % sizeof(uint32_t)) == 0)
+    {
+      // whole blocks go straight to the caller
+      if (!pblock)
+        memset(dst, 0, nblocks * fs.block_size);
+      else if (dev_read(pblock, nblocks, dst) != 0)
+        return done ? done : -EIO;
+      done += nblocks * fs.block_size;
+    }
+    else
+    {
+      size_t chunk = MIN(fs.block_size - boff, len - done);
+      if (!pblock)
+        memset(dst, 0, chunk);
+      else if (dev_read(pblock, 1, bounce) != 0)
+        return done ? done : -EIO;
+      else
+        memcpy(dst, bounce + boff, chunk);
+      done += chunk;
+    }
+  }
+  return done;
+}
+
+static void ext2_stat(fs_node_t* n, struct stat* s)
+{
+  memset(s, 0, sizeof(*s));
+  s->st_ino = n->ino;
+  s->st_mode = n->mode;
+  s->st_nlink = n->nlink;
+  s->st_uid = n->uid;
+  s->st_gid = n->gid;
+  s->st_size = n->size;
+  s->st_blksize = fs.block_size;
+  s->st_blocks = n->blocks;
+  s->st_atime = n->atime;
+  s->st_mtime = n->mtime;
+  s->st_ctime = n->ctime;
+}
+
+static const fs_t ext2 = {
+  .lookup = ext2_lookup,
+  .pread = ext2_pread,
+  .stat = ext2_stat,
+};
+
+// Is there an ext2 superblock we can read in the filesystem at sector start?
+static int probe(uint64_t start, char* sb)
+{
+  if (sdhost_read(start + EXT2_SUPER_OFFSET / SECTOR_SIZE, sb, 2) != 0 ||
+      get16(sb, SB_MAGIC) != EXT2_MAGIC)
+    return 0;
+
+  uint32_t log = get32(sb, SB_LOG_BLOCK_SIZE);
+  if (log > 6 || get32(sb, SB_INODES_PER_GROUP) == 0)
+    return 0;
+
+  uint32_t incompat = get32(sb, SB_REV_LEVEL) ? get32(sb, SB_FEATURE_INCOMPAT) : 0;
+  if (incompat & ~EXT2_SUPPORTED)
+  {
+    printk("ext2: unsupported features %x\n", incompat & ~EXT2_SUPPORTED);
+    return 0;
+  }
+
+  fs.start = start;
+  fs.block_size = 1024 << log;
+  fs.sectors_per_block = fs.block_size / SECTOR_SIZE;
+  fs.first_data_block = get32(sb, SB_FIRST_DATA_BLOCK);
+  fs.inodes_per_group = get32(sb, SB_INODES_PER_GROUP);
+  fs.inode_size = get32(sb, SB_REV_LEVEL) ? get16(sb, SB_INODE_SIZE) : 128;
+  fs.desc_size = (incompat & INCOMPAT_64BIT) ? get16(sb, SB_DESC_SIZE) : 32;
+  return fs.inode_size >= 128 && fs.desc_size >= 32;
+}
+
+#define MBR_SIGNATURE 510
+#define MBR_PARTITIONS 446
+#define MBR_PART_TYPE 4
+#define MBR_PART_START 8
+
+// Mount the ext2 filesystem on the SD card, either the whole card or the
+// first MBR partition holding one, under prefix.
+int ext2_mount(const char* prefix)
+{
+  if (!sdhost)
+    return -ENODEV;
+
+  // the registers are at a physical address, out of pk's sight until now
+  sdhost = (void*)map_kernel_window((uintptr_t)sdhost, RISCV_PGSIZE, PROT_READ | PROT_WRITE);
+  if (sdhost_init() != 0)
+    return -EIO;
+
+  char* sb = (char*)kernel_page_alloc(1);
+  if (!sb)
+    return -ENOMEM;
+
+  int found = probe(0, sb);
+  if (!found && sdhost_read(0, sb, 1) == 0 &&
+      (unsigned char)sb[MBR_SIGNATURE] == 0x55 && (unsigned char)sb[MBR_SIGNATURE+1] == 0xaa)
+  {
+    char mbr[SECTOR_SIZE];
+    memcpy(mbr, sb, sizeof(mbr));
+    for (int i = 0; i < 4 && !found; i++)
+    {
+      const char* part = mbr + MBR_PARTITIONS + 16 * i;
+      if (part[MBR_PART_TYPE])
+        found = probe(get32(part, MBR_PART_START), sb);
+    }
+  }
+  if (!found)
+    return -ENOENT;
+
+  // the superblock's page becomes the bounce buffer
+  size_t cache_pages = ROUNDUP(CACHE_SLOTS * fs.block_size, RISCV_PGSIZE) / RISCV_PGSIZE;
+  bounce = fs.block_size <= RISCV_PGSIZE ? sb :
+           (char*)kernel_page_alloc(fs.block_size / RISCV_PGSIZE);
+  cache = (char*)kernel_page_alloc(cache_pages);
+  if (!bounce || !cache)
+    return -ENOMEM;
+  if (!get_node(EXT2_ROOT_INO))
+    return -EIO;
+
+  // the prefix may live on a stack that's about to be reused
+  size_t len = strlen(prefix) + 1;
+  char* name = len <= RISCV_PGSIZE ? (char*)kernel_page_alloc(1) : NULL;
+  if (!name)
+    return -ENOMEM;
+  memcpy(name, prefix, len);
+  return fs_mount(name, &ext2);
+}
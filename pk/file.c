@@ -8,6 +8,7 @@
 #include "pk.h"
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 
 #define MAX_FDS 128
 static file_t* fds[MAX_FDS];
@@ -25,10 +26,13 @@ void file_decref(file_t* f)
   if (atomic_add(&f->refcnt, -1) == 2)
   {
     int kfd = f->kfd;
+    const fs_t* fs = f->fs;
+    f->fs = NULL;
     mb();
     atomic_set(&f->refcnt, 0);
 
-    frontend_syscall(SYS_close, kfd, 0, 0, 0, 0, 0, 0);
+    if (!fs)
+      frontend_syscall(SYS_close, kfd, 0, 0, 0, 0, 0, 0);
   }
 }
 
@@ -98,8 +102,79 @@ file_t* file_open(const char* fn, int flags, int mode)
   return file_openat(AT_FDCWD, fn, flags, mode);
 }
 
+#define MAX_MOUNTS 4
+static struct {
+  const char* prefix;
+  size_t len;
+  const fs_t* fs;
+} mounts[MAX_MOUNTS];
+
+int fs_mount(const char* prefix, const fs_t* fs)
+{
+  size_t len = strlen(prefix);
+  while (len > 0 && prefix[len-1] == '/')
+    len--;
+
+  for (int i = 0; i < MAX_MOUNTS; i++)
+  {
+    if (!mounts[i].fs)
+    {
+      mounts[i].prefix = prefix;
+      mounts[i].len = len;
+      mounts[i].fs = fs;
+      return 0;
+    }
+  }
+  return -ENOMEM;
+}
+
+// Which mounted filesystem serves fn, or NULL if the host does.  *node is
+// the file, or NULL if there isn't one by that name.
+const fs_t* fs_resolve(int dirfd, const char* fn, fs_node_t** node)
+{
+  if (dirfd != AT_FDCWD && fn[0] != '/')
+    return NULL;
+
+  for (int i = 0; i < MAX_MOUNTS && mounts[i].fs; i++)
+  {
+    size_t len = mounts[i].len;
+    if (strncmp(fn, mounts[i].prefix, len) == 0 && (fn[len] == '/' || fn[len] == '\0'))
+    {
+      fn += len;
+      while (*fn == '/')
+        fn++;
+      *node = mounts[i].fs->lookup(fn);
+      return mounts[i].fs;
+    }
+  }
+  return NULL;
+}
+
+static file_t* fs_open(const fs_t* fs, fs_node_t* node, int flags)
+{
+  if (!node)
+    return ERR_PTR((flags & O_CREAT) ? -EROFS : -ENOENT);
+  if ((flags & O_ACCMODE) != O_RDONLY)
+    return ERR_PTR(-EROFS);
+
+  file_t* f = file_get_free();
+  if (f == NULL)
+    return ERR_PTR(-ENOMEM);
+
+  f->kfd = -1;
+  f->fs = fs;
+  f->node = node;
+  f->pos = 0;
+  return f;
+}
+
 file_t* file_openat(int dirfd, const char* fn, int flags, int mode)
 {
+  fs_node_t* node;
+  const fs_t* fs = fs_resolve(dirfd, fn, &node);
+  if (fs)
+    return fs_open(fs, node, flags);
+
   file_t* f = file_get_free();
   if (f == NULL)
     return ERR_PTR(-ENOMEM);
@@ -131,32 +206,72 @@ int fd_close(int fd)
   return 0;
 }
 
+// The host accesses buffers by physical address, and user pages need not
+// be physically contiguous, so issue one request per contiguous run.
+static ssize_t file_rw(long n, file_t* f, uintptr_t buf, size_t size, off_t offset)
+{
+  ssize_t done = 0;
+  while (size > 0)
+  {
+    size_t len = pa_contig_len(buf, size);
+    long ret = frontend_syscall(n, f->kfd, va2pa(buf), len, offset + done, 0, 0, 0);
+    if (ret < 0)
+      return done ? done : ret;
+
+    done += ret;
+    buf += ret;
+    size -= ret;
+    if (ret < len)
+      break;
+  }
+  return done;
+}
+
 ssize_t file_read(file_t* f, void* buf, size_t size)
 {
   populate_mapping(buf, size, PROT_WRITE);
-  return frontend_syscall(SYS_read, f->kfd, va2pa(buf), size, 0, 0, 0, 0);
+  if (f->fs)
+  {
+    ssize_t ret = f->fs->pread(f->node, buf, size, f->pos);
+    if (ret > 0)
+      f->pos += ret;
+    return ret;
+  }
+  return file_rw(SYS_read, f, (uintptr_t)buf, size, 0);
 }
 
 ssize_t file_pread(file_t* f, void* buf, size_t size, off_t offset)
 {
   populate_mapping(buf, size, PROT_WRITE);
-  return frontend_syscall(SYS_pread, f->kfd, va2pa(buf), size, offset, 0, 0, 0);
+  if (f->fs)
+    return f->fs->pread(f->node, buf, size, offset);
+  return file_rw(SYS_pread, f, (uintptr_t)buf, size, offset);
 }
 
 ssize_t file_write(file_t* f, const void* buf, size_t size)
 {
+  if (f->fs)
+    return -EBADF;
   populate_mapping(buf, size, PROT_READ);
-  return frontend_syscall(SYS_write, f->kfd, va2pa(buf), size, 0, 0, 0, 0);
+  return file_rw(SYS_write, f, (uintptr_t)buf, size, 0);
 }
 
 ssize_t file_pwrite(file_t* f, const void* buf, size_t size, off_t offset)
 {
+  if (f->fs)
+    return -EBADF;
   populate_mapping(buf, size, PROT_READ);
-  return frontend_syscall(SYS_pwrite, f->kfd, va2pa(buf), size, offset, 0, 0, 0);
+  return file_rw(SYS_pwrite, f, (uintptr_t)buf, size, offset);
 }
 
 int file_stat(file_t* f, struct stat* s)
 {
+  if (f->fs)
+  {
+    f->fs->stat(f->node, s);
+    return 0;
+  }
+
   struct frontend_stat buf;
   long ret = frontend_syscall(SYS_fstat, f->kfd, va2pa(&buf), 0, 0, 0, 0, 0);
   copy_stat(s, &buf);
@@ -165,10 +280,23 @@ int file_stat(file_t* f, struct stat* s)
 
 int file_truncate(file_t* f, off_t len)
 {
+  if (f->fs)
+    return -EINVAL;
   return frontend_syscall(SYS_ftruncate, f->kfd, len, 0, 0, 0, 0, 0);
 }
 
 ssize_t file_lseek(file_t* f, size_t ptr, int dir)
 {
+  if (f->fs)
+  {
+    struct stat s;
+    f->fs->stat(f->node, &s);
+    off_t pos = dir == SEEK_SET ? (off_t)ptr :
+                dir == SEEK_CUR ? f->pos + (off_t)ptr :
+                dir == SEEK_END ? s.st_size + (off_t)ptr : -1;
+    if (pos < 0)
+      return -EINVAL;
+    return f->pos = pos;
+  }
   return frontend_syscall(SYS_lseek, f->kfd, ptr, dir, 0, 0, 0, 0);
 }
@@ -7,10 +7,27 @@
 #include <unistd.h>
 #include <stdint.h>
 
+typedef struct fs_node fs_node_t;
+
+// A read-only filesystem pk serves itself, for the paths under the prefix
+// it is mounted at
+typedef struct fs
+{
+  fs_node_t* (*lookup)(const char* path); // relative to the mount point
+  ssize_t (*pread)(fs_node_t* node, void* buf, size_t n, off_t off);
+  void (*stat)(fs_node_t* node, struct stat* s);
+  // physical address of the file's page at off, if it may be mapped in
+  // place, or 0; may be NULL
+  uintptr_t (*page)(fs_node_t* node, off_t off);
+} fs_t;
+
 typedef struct file
 {
   int kfd; // file descriptor on the host side of the HTIF
   uint32_t refcnt;
+  const fs_t* fs; // unless pk serves the file from this filesystem
+  fs_node_t* node;
+  off_t pos;
 } file_t;
 
 extern file_t files[];
@@ -35,6 +52,11 @@ int file_truncate(file_t* f, off_t len);
 int file_stat(file_t* f, struct stat* s);
 int fd_close(int fd);
 
+int fs_mount(const char* prefix, const fs_t* fs);
+const fs_t* fs_resolve(int dirfd, const char* fn, fs_node_t** node);
+int ramfs_mount(const char* prefix);
+int ext2_mount(const char* prefix);
+
 void file_init();
 
 #endif
@@ -86,13 +86,6 @@ static void handle_fault_store(trapframe_t* tf)
     segfault(tf, tf->badvaddr, "store");
 }
 
-static void handle_syscall(trapframe_t* tf)
-{
-  tf->gpr[10] = do_syscall(tf->gpr[10], tf->gpr[11], tf->gpr[12], tf->gpr[13],
-                           tf->gpr[14], tf->gpr[15], tf->gpr[17]);
-  tf->epc += 4;
-}
-
 static void handle_interrupt(trapframe_t* tf)
 {
   clear_csr(sip, SIP_SSIP);
@@ -112,7 +105,6 @@ void handle_trap(trapframe_t* tf)
     [CAUSE_STORE_ACCESS] = handle_store_access_fault,
     [CAUSE_FETCH_PAGE_FAULT] = handle_fault_fetch,
     [CAUSE_ILLEGAL_INSTRUCTION] = handle_illegal_instruction,
-    [CAUSE_USER_ECALL] = handle_syscall,
     [CAUSE_BREAKPOINT] = handle_breakpoint,
     [CAUSE_MISALIGNED_LOAD] = handle_misaligned_load,
     [CAUSE_MISALIGNED_STORE] = handle_misaligned_store,
@@ -6,6 +6,7 @@
 #include "boot.h"
 #include "bits.h"
 #include "mtrap.h"
+#include "mcall.h"
 #include <stdint.h>
 #include <errno.h>
 
@@ -16,24 +17,112 @@ typedef struct {
   size_t offset;
   unsigned refcnt;
   int prot;
+  uintptr_t fa_lo; // first page of the last fault-around cluster
+  uintptr_t fa_hi; // first page past the last fault-around cluster
+  size_t fa_window;
+  int hint; // VMR_* superpage policy from madvise
+  int shared; // MAP_SHARED file mapping: refcnt counts resident pages too
+  unsigned long gen; // creation order, see __shared_owner
 } vmr_t;
 
+#define VMR_HUGEPAGE 1   // fault in whole megapage-aligned blocks
+#define VMR_NOHUGEPAGE 2 // fault in single pages only
+
 #define MAX_VMR (RISCV_PGSIZE / sizeof(vmr_t))
 static spinlock_t vm_lock = SPINLOCK_INIT;
 static vmr_t* vmrs;
+static unsigned long vmr_gen;
+static size_t shared_vmrs;
+
+// Resident pages of shared mappings carry this RSW bit and start out
+// clean, so the D bit tells which ones must be written back.
+#define PTE_SHARED 0x200
 
 uintptr_t first_free_paddr;
 static uintptr_t first_free_page;
 static size_t next_free_page;
 static size_t free_pages;
 
+// User frames are [first_free_paddr, DRAM_BASE + mem_size).  Faults prefer
+// the frame at the same offset as the faulting page, so untouched regions
+// stay physically contiguous, but mremap moves pages without their frames,
+// so ownership is tracked explicitly.
+#define FRAME_MAP_BITS (8 * sizeof(uintptr_t))
+static uintptr_t* frame_map; // one bit per user frame, set while in use
+static size_t frame_map_words;
+static size_t user_frames;
+static size_t frame_hint;
+
+// Free frames that are already known to hold zeros, so a fault can map
+// them without clearing them first.  See refill_zero_pool.
+#define ZERO_BATCH 16
+#define ZERO_POOL_LOW(n) ((n) / 2) // wake the other harts to refill here
+#define PTE_ZEROED 0x100 // RSW bit: the frame came from the zero pool
+// A program image and a ramfs archive preloaded into memory, whose pages
+// user mappings may share.  They are never handed out or freed as user
+// frames.
+uintptr_t image_start, image_end;
+uintptr_t ramfs_start, ramfs_end;
+
+size_t rss_pages; // user frames in use, and the most there have been
+size_t peak_rss_pages;
+unsigned long minor_faults; // resolved without I/O
+unsigned long major_faults; // had to read the backing file
+
+static uintptr_t* zero_map; // one bit per free user frame known to be zero
+static size_t zero_frames;
+static size_t zero_cursor; // where the next refill starts looking
+
+// The kernel's mappings are global, and the user's are tagged with this
+// ASID (0 if the hart has none), so user TLB maintenance never throws away
+// the kernel's translations.
+static uintptr_t user_asid;
+
+// Sv39 by default (Sv32 on RV32); --vm=svN asks for another mode
+int vm_bits;
+static uintptr_t satp_mode;
+static int pt_levels;
+#define TLB_FLUSH_PAGES 32 // past this many pages, flush the whole ASID
+
 int demand_paging = 1; // unless -p flag is given
+size_t fault_around_pages = 16; // --fault-around=N; 1 disables it
+size_t zero_pool_frames = 256; // --zero-pool=N; 0 disables it
+size_t mmap_gap = 16 << 20; // --mmap-gap=N MiB between the stack and mmaps
+
+// The stack starts small and grows down on faults, up to RLIMIT_STACK,
+// as long as that leaves a guard gap clear below it.
+#define STACK_INIT_SIZE (16 * RISCV_PGSIZE)
+#define STACK_GUARD_GAP (256 * RISCV_PGSIZE)
+size_t stack_rlimit; // set up by pk_vm_init
+size_t stack_rlimit_max = -1;
+static uintptr_t stack_bottom;
+
+// Zero whole pages, a cache block at a time with cbo.zero if every hart
+// has Zicboz, and otherwise with unrolled word stores.  Callers only ever
+// clear page-aligned, page-sized runs, so skip memset's generic checks.
+static void __attribute__((optimize("no-tree-loop-distribute-patterns")))
+__clear_pages(uintptr_t addr, size_t npages)
+{
+  if (cboz_block_size)
+  {
+    for (uintptr_t end = addr + npages * RISCV_PGSIZE; addr < end; addr += cboz_block_size)
+      cbo_zero(addr);
+    return;
+  }
+
+  uintptr_t* p = (uintptr_t*)addr;
+  uintptr_t* end = p + npages * (RISCV_PGSIZE / sizeof(uintptr_t));
+  for ( ; p < end; p += 8) {
+    p[0] = 0; p[1] = 0; p[2] = 0; p[3] = 0;
+    p[4] = 0; p[5] = 0; p[6] = 0; p[7] = 0;
+  }
+}
 
 static uintptr_t __page_alloc()
 {
   kassert(next_free_page != free_pages);
   uintptr_t addr = first_free_page + RISCV_PGSIZE * next_free_page++;
-  memset((void*)addr, 0, RISCV_PGSIZE);
+  __clear_pages(addr, 1);
   return addr;
 }
 
@@ -61,21 +150,48 @@ static vmr_t* __vmr_alloc(uintptr_t addr, size_t length, file_t* file,
       v->offset = offset;
       v->refcnt = refcnt;
       v->prot = prot;
+      v->fa_lo = v->fa_hi = 0;
+      v->fa_window = 1;
+      v->hint = 0;
+      v->shared = 0;
+      v->gen = ++vmr_gen;
       return v;
     }
   }
   return NULL;
 }
 
+static void __vmr_share(vmr_t* v)
+{
+  v->shared = 1;
+  shared_vmrs++;
+}
+
 static void __vmr_decref(vmr_t* v, unsigned dec)
 {
   if ((v->refcnt -= dec) == 0)
   {
     if (v->file)
       file_decref(v->file);
+    if (v->shared)
+      shared_vmrs--;
   }
 }
 
+// Resident pages don't point back at their VMR, so the owner of a shared
+// page is found by address: a page only ever joins the VMR that was
+// created for it, so its owner is the newest live shared VMR covering it.
+static vmr_t* __shared_owner(uintptr_t addr)
+{
+  vmr_t* owner = NULL;
+  for (vmr_t* v = vmrs; v < vmrs + MAX_VMR; v++)
+    if (v->refcnt && v->shared && addr - v->addr < ROUNDUP(v->length, RISCV_PGSIZE) &&
+        (!owner || v->gen > owner->gen))
+      owner = v;
+  kassert(owner);
+  return owner;
+}
+
 static size_t pte_ppn(pte_t pte)
 {
   return pte >> PTE_PPN_SHIFT;
@@ -92,55 +208,235 @@ static size_t pt_idx(uintptr_t addr, int level)
   return idx & ((1 << RISCV_PGLEVEL_BITS) - 1);
 }
 
-static pte_t* __walk_create(uintptr_t addr);
+static int __frame_in_use(size_t f)
+{
+  return (frame_map[f / FRAME_MAP_BITS] >> (f % FRAME_MAP_BITS)) & 1;
+}
 
-static pte_t* __attribute__((noinline)) __continue_walk_create(uintptr_t addr, pte_t* pte)
+// Interrupt the harts idling in boot_other_hart so they refill the zero
+// pool.  Frames are only handed out once pk is in S-mode, so this goes
+// through the SBI; hart 0 is the one running the program.
+static void __wake_zero_pool()
 {
-  *pte = ptd_create(ppn(__page_alloc()));
-  return __walk_create(addr);
+  uintptr_t mask = ~1UL;
+  register uintptr_t a0 asm ("a0") = (uintptr_t)&mask;
+  register uintptr_t a7 asm ("a7") = SBI_SEND_IPI;
+  asm volatile ("ecall" : "+r" (a0) : "r" (a7) : "memory");
+}
+
+// Returns the PPN of a free user frame, preferably the one linearly
+// backing vaddr, or 0 if physical memory is exhausted.  *zeroed says
+// whether the frame came from the zero pool.
+static uintptr_t __frame_alloc(uintptr_t vaddr, int* zeroed)
+{
+  size_t f = vaddr >> RISCV_PGSHIFT;
+  if (f >= user_frames || __frame_in_use(f))
+  {
+    size_t i;
+    for (i = 0; i < frame_map_words; i++)
+      if (~frame_map[(frame_hint + i) % frame_map_words])
+        break;
+    if (i == frame_map_words)
+      return 0;
+
+    size_t w = (frame_hint + i) % frame_map_words;
+    f = w * FRAME_MAP_BITS + __builtin_ctzl(~frame_map[w]);
+    frame_hint = w;
+  }
+
+  uintptr_t bit = 1UL << (f % FRAME_MAP_BITS);
+  frame_map[f / FRAME_MAP_BITS] |= bit;
+  if ((*zeroed = (zero_map[f / FRAME_MAP_BITS] & bit) != 0))
+  {
+    zero_map[f / FRAME_MAP_BITS] &= ~bit;
+    if (--zero_frames == ZERO_POOL_LOW(zero_pool_frames))
+      __wake_zero_pool();
+  }
+  // refills work just ahead of the allocator, which mostly goes in order
+  zero_cursor = f + 1 < user_frames ? f + 1 : 0;
+  if (++rss_pages > peak_rss_pages)
+    peak_rss_pages = rss_pages;
+  return f + ppn(first_free_paddr);
 }
 
-static pte_t* __walk_internal(uintptr_t addr, int create)
+// Frames user mappings may share without owning: those of preloaded blobs,
+// and of pk itself, such as the vDSO's.
+static int __preloaded(uintptr_t pfn)
+{
+  return kernel_va(pfn << RISCV_PGSHIFT) ||
+         (pfn >= ppn(image_start) && pfn < ppn(ROUNDUP(image_end, RISCV_PGSIZE))) ||
+         (pfn >= ppn(ramfs_start) && pfn < ppn(ROUNDUP(ramfs_end, RISCV_PGSIZE)));
+}
+
+static void __reserve_frames(uintptr_t* fmap, uintptr_t lo, uintptr_t hi)
+{
+  for (uintptr_t pa = ROUNDDOWN(lo, RISCV_PGSIZE); pa < hi; pa += RISCV_PGSIZE)
+  {
+    size_t f = (pa - first_free_paddr) >> RISCV_PGSHIFT;
+    if (pa >= first_free_paddr && f < user_frames)
+      fmap[f / FRAME_MAP_BITS] |= 1UL << (f % FRAME_MAP_BITS);
+  }
+}
+
+// pk zeroes and hands out pages of its own pool without regard for what
+// they hold, so the platform mustn't have put a preloaded blob there.
+static void __check_outside_pool(uintptr_t start, uintptr_t end, const char* what)
+{
+  if (start < end && start < first_free_paddr && end > first_free_page)
+    panic("the preloaded %s at [%p, %p) overlaps pk's pages at [%p, %p)",
+          what, start, end, first_free_page, first_free_paddr);
+}
+
+static void __frame_free(uintptr_t pfn)
+{
+  if (__preloaded(pfn))
+    return;
+
+  size_t f = pfn - ppn(first_free_paddr);
+  kassert(f < user_frames && __frame_in_use(f));
+  frame_map[f / FRAME_MAP_BITS] &= ~(1UL << (f % FRAME_MAP_BITS));
+  rss_pages--;
+}
+
+// Page-table pages come from the kernel page pool, and go back to this
+// free list when unmapping empties them, so churning mmaps doesn't use
+// the pool up.  A freed page is all zero except for the link.
+static uintptr_t pt_free_list;
+
+static uintptr_t __pt_alloc()
+{
+  if (!pt_free_list)
+    return __page_alloc();
+
+  uintptr_t page = pt_free_list;
+  pt_free_list = *(uintptr_t*)page;
+  *(uintptr_t*)page = 0;
+  return page;
+}
+
+static void __pt_free(uintptr_t page)
+{
+  *(uintptr_t*)page = pt_free_list;
+  pt_free_list = page;
+}
+
+static pte_t* __walk_internal(uintptr_t addr, int create, int level);
+
+static pte_t* __attribute__((noinline)) __continue_walk_create(uintptr_t addr, pte_t* pte, int level)
+{
+  *pte = ptd_create(ppn(__pt_alloc()));
+  return __walk_internal(addr, 1, level);
+}
+
+// Returns the PTE mapping addr at the given level, or 0 if there is no
+// such table, or addr lies in a larger superpage.
+static pte_t* __walk_internal(uintptr_t addr, int create, int level)
 {
   pte_t* t = root_page_table;
-  for (int i = (VA_BITS - RISCV_PGSHIFT) / RISCV_PGLEVEL_BITS - 1; i > 0; i--) {
+  for (int i = pt_levels - 1; i > level; i--) {
     size_t idx = pt_idx(addr, i);
     if (unlikely(!(t[idx] & PTE_V)))
-      return create ? __continue_walk_create(addr, &t[idx]) : 0;
+      return create ? __continue_walk_create(addr, &t[idx], level) : 0;
+    if (unlikely(!PTE_TABLE(t[idx])))
+      return 0;
     t = (pte_t*)(pte_ppn(t[idx]) << RISCV_PGSHIFT);
   }
-  return &t[pt_idx(addr, 0)];
+  return &t[pt_idx(addr, level)];
 }
 
 static pte_t* __walk(uintptr_t addr)
 {
-  return __walk_internal(addr, 0);
+  return __walk_internal(addr, 0, 0);
 }
 
 static pte_t* __walk_create(uintptr_t addr)
 {
-  return __walk_internal(addr, 1);
+  return __walk_internal(addr, 1, 0);
+}
+
+// Give the leaf page tables covering [lo, hi) that no longer map anything
+// back to the pool.  A per-page sfence.vma needn't drop cached non-leaf
+// entries, so this flushes the whole user address space if it frees any.
+static void __reclaim_page_tables(uintptr_t lo, uintptr_t hi)
+{
+  int freed = 0;
+  for (uintptr_t a = ROUNDDOWN(lo, MEGAPAGE_SIZE); a < hi; a += MEGAPAGE_SIZE)
+  {
+    pte_t* ptd = __walk_internal(a, 0, 1);
+    if (ptd == 0 || !(*ptd & PTE_V) || !PTE_TABLE(*ptd))
+      continue;
+
+    pte_t* t = (pte_t*)(pte_ppn(*ptd) << RISCV_PGSHIFT);
+    size_t i;
+    for (i = 0; i < RISCV_PGSIZE / sizeof(pte_t); i++)
+      if (t[i])
+        break;
+    if (i == RISCV_PGSIZE / sizeof(pte_t))
+    {
+      *ptd = 0;
+      __pt_free((uintptr_t)t);
+      freed = 1;
+    }
+  }
+
+  if (freed)
+    flush_tlb_asid(user_asid);
+}
+
+// Flush the user translations of [lo, hi): one sfence.vma per page for
+// small ranges, one for the whole address space beyond that.
+static void __flush_range(uintptr_t lo, uintptr_t hi)
+{
+  if (hi - lo > TLB_FLUSH_PAGES * RISCV_PGSIZE)
+    flush_tlb_asid(user_asid);
+  else
+    for (uintptr_t a = lo; a < hi; a += RISCV_PGSIZE)
+      flush_tlb_page(a, user_asid);
 }
 
 static int __va_avail(uintptr_t vaddr)
 {
+  if (kernel_va(vaddr))
+    return 0;
   pte_t* pte = __walk(vaddr);
   return pte == 0 || *pte == 0;
 }
 
+static int __range_avail(uintptr_t addr, size_t len)
+{
+  for (uintptr_t a = addr; a < addr + len; a += RISCV_PGSIZE)
+    if (!__va_avail(a))
+      return 0;
+  return 1;
+}
+
+// The heap grows up from the end of the program, and mmap hands out
+// addresses top-down from mmap_gap below the stack, so neither starves the
+// other until the address space is really full.
+static uintptr_t __mmap_base()
+{
+  size_t stack = ROUNDUP(MIN(stack_rlimit, current.mmap_max / 4), RISCV_PGSIZE);
+  size_t gap = MIN(ROUNDUP(mmap_gap, RISCV_PGSIZE), ROUNDDOWN(current.mmap_max / 8, RISCV_PGSIZE));
+  return current.stack_top - stack - gap;
+}
+
+static uintptr_t __brk_floor()
+{
+  return ROUNDUP(MAX(current.brk, current.brk_min), RISCV_PGSIZE);
+}
+
+// Find the highest free run of npage pages between the heap and the mmap
+// base.
 static uintptr_t __vm_alloc(size_t npage)
 {
-  uintptr_t start = current.brk, end = current.mmap_max - npage*RISCV_PGSIZE;
-  for (uintptr_t a = start; a <= end; a += RISCV_PGSIZE)
+  uintptr_t floor = __brk_floor(), end = __mmap_base();
+  for (uintptr_t a = end; a > floor; )
   {
+    a -= RISCV_PGSIZE;
     if (!__va_avail(a))
-      continue;
-    uintptr_t first = a, last = a + (npage-1) * RISCV_PGSIZE;
-    for (a = last; a > first && __va_avail(a); a -= RISCV_PGSIZE)
-      ;
-    if (a > first)
-      continue;
-    return a;
+      end = a;
+    else if (end - a == npage * RISCV_PGSIZE)
+      return a;
   }
   return 0;
 }
@@ -156,48 +452,270 @@ static inline pte_t prot_to_type(int prot, int user)
   return pte;
 }
 
+static inline pte_t user_type(int prot, int shared)
+{
+  pte_t type = prot_to_type(prot, 1);
+  return shared ? (type & ~PTE_D) | PTE_SHARED : type;
+}
+
 int __valid_user_range(uintptr_t vaddr, size_t len)
 {
   if (vaddr + len < vaddr)
     return 0;
+  if (vaddr < first_free_paddr && vaddr + len > DRAM_BASE)
+    return 0;
   return vaddr + len <= current.mmap_max;
 }
 
+// Size the fault-around cluster for a fault at vaddr.  A VMR that keeps
+// faulting just past (or, for stacks, just below) its previous cluster is
+// being streamed through, so its window doubles up to fault_around_pages.
+// Any other fault drops the window back to a single page, so sparse access
+// patterns don't zero and commit memory they never touch.
+static size_t __fault_around_window(vmr_t* v, uintptr_t vaddr, int* down)
+{
+  *down = 0;
+  if (v->file || fault_around_pages <= 1 || (v->hint & VMR_NOHUGEPAGE))
+    return 1;
+
+  if (vaddr == v->fa_hi)
+    v->fa_window = MIN(v->fa_window * 2, fault_around_pages);
+  else if (vaddr + RISCV_PGSIZE == v->fa_lo)
+    v->fa_window = MIN(v->fa_window * 2, fault_around_pages), *down = 1;
+  else
+    v->fa_window = 1;
+
+  return v->fa_window;
+}
+
+// Is the page at vaddr still an untouched part of VMR v?
+static int __vmr_page_pending(vmr_t* v, uintptr_t vaddr)
+{
+  if (!__valid_user_range(vaddr, 1))
+    return 0;
+  pte_t* pte = __walk(vaddr);
+  return pte && *pte == (pte_t)v;
+}
+
+// Back [lo, hi) with fresh frames, mapped for the kernel only so they can
+// be filled whatever the VMR's protection.  All or nothing.
+static int __map_frames(vmr_t* v, uintptr_t lo, uintptr_t hi)
+{
+  for (uintptr_t a = lo; a < hi; a += RISCV_PGSIZE)
+  {
+    int zeroed;
+    uintptr_t pfn = __frame_alloc(a, &zeroed);
+    if (!pfn)
+    {
+      for (uintptr_t b = lo; b < a; b += RISCV_PGSIZE)
+      {
+        pte_t* pte = __walk(b);
+        __frame_free(pte_ppn(*pte));
+        *pte = (pte_t)v;
+      }
+      return -1;
+    }
+    *__walk(a) = pte_create(pfn, prot_to_type(PROT_READ|PROT_WRITE, 0)) |
+                 (zeroed ? PTE_ZEROED : 0);
+  }
+  return 0;
+}
+
+// Fault in [lo, hi), all of which must still be pending in VMR v.  The
+// range is contiguous in VA space, so it is read from the file in one go,
+// or cleared in runs, skipping frames that came from the zero pool.
+static int __populate_range(vmr_t* v, uintptr_t lo, uintptr_t hi)
+{
+  if (__map_frames(v, lo, hi) != 0)
+    return -1;
+
+  size_t len = hi - lo;
+  __flush_range(lo, hi);
+  if (v->file)
+  {
+    size_t flen = MIN(len, v->length - (lo - v->addr));
+    ssize_t ret = file_pread(v->file, (void*)lo, flen, lo - v->addr + v->offset);
+    kassert(ret >= 0);
+    if (ret < len)
+      memset((void*)lo + ret, 0, len - ret);
+  }
+  else
+  {
+    for (uintptr_t a = lo; a < hi; )
+    {
+      uintptr_t b = a;
+      while (b < hi && !(*__walk(b) & PTE_ZEROED))
+        b += RISCV_PGSIZE;
+      __clear_pages(a, (b - a) / RISCV_PGSIZE);
+      a = b + RISCV_PGSIZE;
+    }
+  }
+
+  pte_t type = user_type(v->prot, v->shared);
+  for (uintptr_t a = lo; a < hi; a += RISCV_PGSIZE)
+  {
+    pte_t* pte = __walk(a);
+    *pte = pte_create(pte_ppn(*pte), type);
+  }
+  __flush_range(lo, hi);
+
+  if (!v->shared)
+    __vmr_decref(v, len / RISCV_PGSIZE);
+  return 0;
+}
+
+static int __shared_dirty(uintptr_t addr, vmr_t* owner)
+{
+  pte_t* pte = __walk(addr);
+  return pte && (*pte & (PTE_V | PTE_SHARED | PTE_D)) == (PTE_V | PTE_SHARED | PTE_D) &&
+         (!owner || __shared_owner(addr) == owner);
+}
+
+// Write the dirty shared pages in [lo, hi) back to their files, one
+// file_pwrite per run of pages that are contiguous in the file, and mark
+// them clean again.
+static void __writeback(uintptr_t lo, uintptr_t hi)
+{
+  int cleaned = 0;
+  for (uintptr_t a = lo; a < hi; a += RISCV_PGSIZE)
+  {
+    if (!__shared_dirty(a, NULL))
+      continue;
+
+    vmr_t* v = __shared_owner(a);
+    uintptr_t b = a + RISCV_PGSIZE;
+    while (b < hi && __shared_dirty(b, v))
+      b += RISCV_PGSIZE;
+
+    // don't write past the end of the mapping
+    size_t len = MIN(b, v->addr + v->length) - a;
+    kassert(file_pwrite(v->file, (void*)a, len, a - v->addr + v->offset) == len);
+
+    for ( ; a < b; a += RISCV_PGSIZE)
+      *__walk(a) &= ~PTE_D;
+    a -= RISCV_PGSIZE;
+    cleaned = 1;
+  }
+
+  if (cleaned)
+    __flush_range(lo, hi);
+}
+
+static int __map_anon_cluster(vmr_t* v, uintptr_t vaddr)
+{
+  int down;
+  size_t window = __fault_around_window(v, vaddr, &down);
+
+  uintptr_t lo = vaddr, hi = vaddr + RISCV_PGSIZE;
+  if (v->hint & VMR_HUGEPAGE) {
+    // take the whole megapage-aligned block, so it ends up backed by
+    // (linearly preferred, hence usually contiguous) frames at once
+    uintptr_t base = ROUNDDOWN(vaddr, MEGAPAGE_SIZE);
+    while (lo > base && __vmr_page_pending(v, lo - RISCV_PGSIZE))
+      lo -= RISCV_PGSIZE;
+    while (hi < base + MEGAPAGE_SIZE && __vmr_page_pending(v, hi))
+      hi += RISCV_PGSIZE;
+  } else if (down) {
+    while ((hi - lo) / RISCV_PGSIZE < window && lo > 0 &&
+           __vmr_page_pending(v, lo - RISCV_PGSIZE))
+      lo -= RISCV_PGSIZE;
+  } else {
+    while ((hi - lo) / RISCV_PGSIZE < window && __vmr_page_pending(v, hi))
+      hi += RISCV_PGSIZE;
+  }
+
+  if (__populate_range(v, lo, hi) != 0)
+  {
+    // short on frames: settle for the faulting page alone
+    lo = vaddr, hi = vaddr + RISCV_PGSIZE;
+    if (__populate_range(v, lo, hi) != 0)
+      return -1;
+  }
+
+  v->fa_lo = lo;
+  v->fa_hi = hi;
+  return 0;
+}
+
+static int __grow_stack(uintptr_t vaddr)
+{
+  uintptr_t bottom = ROUNDDOWN(vaddr, RISCV_PGSIZE);
+  size_t grow = stack_bottom - bottom;
+  if (vaddr >= stack_bottom || current.stack_top - bottom > stack_rlimit ||
+      bottom < STACK_GUARD_GAP ||
+      !__range_avail(bottom - STACK_GUARD_GAP, STACK_GUARD_GAP + grow))
+    return -1;
+
+  // extend the stack's VMR if its lowest page hasn't been touched yet, so
+  // downward fault-around carries on; otherwise map a new one
+  pte_t* pte = __walk(stack_bottom);
+  vmr_t* v = pte && *pte && !(*pte & PTE_V) ? (vmr_t*)*pte : NULL;
+  if (v && !v->file && v->addr == stack_bottom)
+  {
+    v->addr = bottom;
+    v->length += grow;
+    v->refcnt += grow / RISCV_PGSIZE;
+    for (uintptr_t a = bottom; a < stack_bottom; a += RISCV_PGSIZE)
+    {
+      pte = __walk_create(a);
+      kassert(pte);
+      *pte = (pte_t)v;
+    }
+  }
+  else if (__do_mmap(bottom, grow, PROT_READ|PROT_WRITE|PROT_EXEC,
+                     MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, 0, 0) != bottom)
+    return -1;
+
+  stack_bottom = bottom;
+  return 0;
+}
+
 static int __handle_page_fault(uintptr_t vaddr, int prot)
 {
   uintptr_t vpn = vaddr >> RISCV_PGSHIFT;
   vaddr = vpn << RISCV_PGSHIFT;
 
   pte_t* pte = __walk(vaddr);
+  int stale = 0;
+
+  if ((pte == 0 || *pte == 0) && __grow_stack(vaddr) == 0)
+    pte = __walk(vaddr);
 
   if (pte == 0 || *pte == 0 || !__valid_user_range(vaddr, 1))
     return -1;
-  else if (!(*pte & PTE_V))
+  else if (*pte & PTE_V)
+  {
+    stale = 1; // resident already; the TLB had an old entry, or D was clear
+    minor_faults++;
+  }
+  else
   {
-    uintptr_t ppn = vpn + (first_free_paddr / RISCV_PGSIZE);
-
     vmr_t* v = (vmr_t*)*pte;
-    *pte = pte_create(ppn, prot_to_type(PROT_READ|PROT_WRITE, 0));
-    flush_tlb();
-    if (v->file)
+    if (!v->file)
     {
-      size_t flen = MIN(RISCV_PGSIZE, v->length - (vaddr - v->addr));
-      ssize_t ret = file_pread(v->file, (void*)vaddr, flen, vaddr - v->addr + v->offset);
-      kassert(ret > 0);
-      if (ret < RISCV_PGSIZE)
-        memset((void*)vaddr + ret, 0, RISCV_PGSIZE - ret);
+      if (__map_anon_cluster(v, vaddr) != 0)
+        return -1;
+      minor_faults++;
     }
     else
-      memset((void*)vaddr, 0, RISCV_PGSIZE);
-    __vmr_decref(v, 1);
-    *pte = pte_create(ppn, prot_to_type(v->prot, 1));
+    {
+      if (__populate_range(v, vaddr, vaddr + RISCV_PGSIZE) != 0)
+        return -1;
+      major_faults++;
+    }
   }
 
+  // the first store to a clean shared page marks it dirty
+  if ((prot & PROT_WRITE) && (*pte & (PTE_SHARED | PTE_W)) == (PTE_SHARED | PTE_W))
+    *pte |= PTE_D;
+
   pte_t perms = pte_create(0, prot_to_type(prot, 1));
   if ((*pte & perms) != perms)
     return -1;
 
-  flush_tlb();
+  // newly populated pages were flushed as they were mapped
+  if (stale)
+    __flush_range(vaddr, vaddr + RISCV_PGSIZE);
   return 0;
 }
 
@@ -211,6 +729,8 @@ int handle_page_fault(uintptr_t vaddr, int prot)
 
 static void __do_munmap(uintptr_t addr, size_t len)
 {
+  __writeback(addr, addr + len);
+
   for (uintptr_t a = addr; a < addr + len; a += RISCV_PGSIZE)
   {
     pte_t* pte = __walk(a);
@@ -219,10 +739,36 @@ static void __do_munmap(uintptr_t addr, size_t len)
 
     if (!(*pte & PTE_V))
       __vmr_decref((vmr_t*)*pte, 1);
+    else
+    {
+      if (*pte & PTE_SHARED)
+        __vmr_decref(__shared_owner(a), 1);
+      __frame_free(pte_ppn(*pte));
+    }
 
     *pte = 0;
   }
-  flush_tlb(); // TODO: shootdown
+  __flush_range(addr, addr + len); // TODO: shootdown
+  __reclaim_page_tables(addr, addr + len);
+}
+
+// Read-only mappings of a file pk serves from memory share the pages its
+// filesystem can lend, rather than copying them.
+static void __map_in_place(vmr_t* v, uintptr_t addr, size_t npage, file_t* f, off_t offset)
+{
+  int mapped = 0;
+  for (size_t i = 0; i < npage; i++)
+  {
+    uintptr_t pa = f->fs->page(f->node, offset + i * RISCV_PGSIZE);
+    if (!pa)
+      continue;
+    *__walk(addr + i * RISCV_PGSIZE) = pte_create(ppn(pa), user_type(v->prot, 0));
+    __vmr_decref(v, 1);
+    mapped = 1;
+  }
+
+  if (mapped)
+    __flush_range(addr, addr + npage * RISCV_PGSIZE);
 }
 
 uintptr_t __do_mmap(uintptr_t addr, size_t length, int prot, int flags, file_t* f, off_t offset)
@@ -236,24 +782,43 @@ uintptr_t __do_mmap(uintptr_t addr, size_t length, int prot, int flags, file_t*
   else if ((addr = __vm_alloc(npage)) == 0)
     return (uintptr_t)-1;
 
+  // Clear out whatever is there before creating the new VMR, which would
+  // otherwise be taken for the owner of the old shared pages.
+  if (!__range_avail(addr, npage * RISCV_PGSIZE))
+    __do_munmap(addr, npage * RISCV_PGSIZE);
+
   vmr_t* v = __vmr_alloc(addr, length, f, offset, npage, prot);
   if (!v)
     return (uintptr_t)-1;
+  if (f && (flags & MAP_SHARED))
+    __vmr_share(v);
 
   for (uintptr_t a = addr; a < addr + length; a += RISCV_PGSIZE)
   {
     pte_t* pte = __walk_create(a);
-    kassert(pte);
-
-    if (*pte)
-      __do_munmap(a, RISCV_PGSIZE);
-
+    kassert(pte && *pte == 0);
     *pte = (pte_t)v;
   }
 
+  if (f && f->fs && f->fs->page && !(prot & PROT_WRITE))
+    __map_in_place(v, addr, npage, f, offset);
+
+  // fill each pending run at once, so file data comes in as few large
+  // reads as the frames' layout allows, and zeroing runs in bulk; when
+  // memory is too short for that, go page by page
   if (!demand_paging || (flags & MAP_POPULATE))
-    for (uintptr_t a = addr; a < addr + length; a += RISCV_PGSIZE)
-      kassert(__handle_page_fault(a, prot) == 0);
+  {
+    for (uintptr_t a = addr, end = addr + npage * RISCV_PGSIZE; a < end; )
+    {
+      uintptr_t b = a;
+      while (b < end && __vmr_page_pending(v, b))
+        b += RISCV_PGSIZE;
+      if (b > a && __populate_range(v, a, b) != 0)
+        for (uintptr_t c = a; c < b; c += RISCV_PGSIZE)
+          kassert(__populate_range(v, c, c + RISCV_PGSIZE) == 0);
+      a = b > a ? b : a + RISCV_PGSIZE;
+    }
+  }
 
   return addr;
 }
@@ -272,18 +837,21 @@ int do_munmap(uintptr_t addr, size_t length)
 
 uintptr_t do_mmap(uintptr_t addr, size_t length, int prot, int flags, int fd, off_t offset)
 {
-  if (!(flags & MAP_PRIVATE) || length == 0 || (offset & (RISCV_PGSIZE-1)))
+  if (!(flags & MAP_PRIVATE) == !(flags & MAP_SHARED) || length == 0 ||
+      (offset & (RISCV_PGSIZE-1)))
     return -EINVAL;
 
   file_t* f = NULL;
   if (!(flags & MAP_ANONYMOUS) && (f = file_get(fd)) == NULL)
     return -EBADF;
+  if (f && f->fs && (flags & MAP_SHARED) && (prot & PROT_WRITE))
+  {
+    file_decref(f);
+    return -EACCES;
+  }
 
   spinlock_lock(&vm_lock);
     addr = __do_mmap(addr, length, prot, flags, f, offset);
-
-    if (addr < current.brk_max)
-      current.brk_max = addr;
   spinlock_unlock(&vm_lock);
 
   if (f) file_decref(f);
@@ -292,20 +860,28 @@ uintptr_t do_mmap(uintptr_t addr, size_t length, int prot, int flags, int fd, of
 
 uintptr_t __do_brk(size_t addr)
 {
+  if (current.brk == 0)
+    current.brk = ROUNDUP(current.brk_min, RISCV_PGSIZE);
+
+  // Raising RLIMIT_STACK moves the mmap base down, possibly below the
+  // heap, so a request past it fails rather than being clamped, which
+  // could shrink the heap.
   uintptr_t newbrk = addr;
   if (addr < current.brk_min)
     newbrk = current.brk_min;
-  else if (addr > current.brk_max)
-    newbrk = current.brk_max;
-
-  if (current.brk == 0)
-    current.brk = ROUNDUP(current.brk_min, RISCV_PGSIZE);
+  else if (addr > __mmap_base())
+    return current.brk;
 
   uintptr_t newbrk_page = ROUNDUP(newbrk, RISCV_PGSIZE);
   if (current.brk > newbrk_page)
     __do_munmap(newbrk_page, current.brk - newbrk_page);
   else if (current.brk < newbrk_page)
+  {
+    // the heap can't grow into an mmap that got there first
+    if (!__range_avail(current.brk, newbrk_page - current.brk))
+      return current.brk;
     kassert(__do_mmap(current.brk, newbrk_page - current.brk, -1, MAP_FIXED|MAP_PRIVATE|MAP_ANONYMOUS, 0, 0) == current.brk);
+  }
   current.brk = newbrk_page;
 
   return newbrk;
@@ -320,9 +896,368 @@ uintptr_t do_brk(size_t addr)
   return addr;
 }
 
-uintptr_t do_mremap(uintptr_t addr, size_t old_size, size_t new_size, int flags)
+// Find a live VMR covering addr.  Resident pages don't point back at their
+// VMR, so this is only a best guess once a region has been faulted in.
+static vmr_t* __vmr_lookup(uintptr_t addr)
+{
+  if (!vmrs)
+    return NULL;
+  for (vmr_t* v = vmrs; v < vmrs + MAX_VMR; v++)
+    if (v->refcnt && addr - v->addr < ROUNDUP(v->length, RISCV_PGSIZE))
+      return v;
+  return NULL;
+}
+
+static int pte_prot(pte_t pte)
+{
+  return ((pte & PTE_R) ? PROT_READ : 0) |
+         ((pte & PTE_W) ? PROT_WRITE : 0) |
+         ((pte & PTE_X) ? PROT_EXEC : 0);
+}
+
+// Map [addr, addr + len) as the continuation of the mapping whose last
+// page is at addr - RISCV_PGSIZE.
+static int __mremap_extend(uintptr_t tail, uintptr_t addr, size_t len)
+{
+  uintptr_t last = tail - RISCV_PGSIZE;
+  pte_t pte = *__walk(last);
+  vmr_t* v = !(pte & PTE_V) ? (vmr_t*)pte :
+             (pte & PTE_SHARED) ? __shared_owner(last) : __vmr_lookup(last);
+  int prot = v ? v->prot : pte_prot(pte);
+  int flags = MAP_FIXED | (v && v->shared ? MAP_SHARED : MAP_PRIVATE);
+  file_t* f = NULL;
+  size_t offset = 0;
+
+  if (v && v->file)
+    f = v->file, offset = v->offset + (tail - v->addr);
+  else
+    flags |= MAP_ANONYMOUS;
+
+  return __do_mmap(addr, len, prot, flags, f, offset) == addr ? 0 : -1;
+}
+
+// A copy of v, limited to the part of it in [old, old + len) and shifted
+// to new, with no pages yet.
+static vmr_t* __vmr_clone(vmr_t* v, uintptr_t old, uintptr_t new, size_t len)
+{
+  uintptr_t lo = MAX(v->addr, old), hi = MIN(v->addr + v->length, old + len);
+  vmr_t* c = __vmr_alloc(lo + (new - old), hi - lo, v->file,
+                         v->offset + (lo - v->addr), 0, v->prot);
+  if (c)
+  {
+    c->hint = v->hint;
+    if (v->shared)
+      __vmr_share(c);
+  }
+  return c;
+}
+
+// Move the mappings of [old, old + len) to [new, new + len) without
+// touching the data.  Resident pages keep their frames; pages that haven't
+// been faulted in yet, and shared pages, move to a copy of their VMR
+// shifted to the new address, so file offsets still work out.
+static void __move_pages(uintptr_t old, uintptr_t new, size_t len)
+{
+  vmr_t *from = NULL, *to = NULL;
+
+  for (uintptr_t off = 0; off < len; off += RISCV_PGSIZE)
+  {
+    pte_t* dst = __walk_create(new + off);
+    pte_t* src = __walk(old + off);
+    kassert(dst && src && *dst == 0);
+
+    vmr_t* v = !*src ? NULL : !(*src & PTE_V) ? (vmr_t*)*src :
+               (*src & PTE_SHARED) ? __shared_owner(old + off) : NULL;
+    if (v)
+    {
+      if (v != from)
+        from = v, to = __vmr_clone(v, old, new, len);
+
+      if (to)
+      {
+        to->refcnt++;
+        __vmr_decref(v, 1);
+        if (!(*src & PTE_V))
+          *src = (pte_t)to;
+      }
+      else
+      {
+        // out of VMRs: fault the page in and move its frame instead.  A
+        // shared page is written back and becomes a private copy.
+        if (!(*src & PTE_V))
+        {
+          __handle_page_fault(old + off, PROT_NONE);
+          kassert(*src & PTE_V);
+        }
+        if (*src & PTE_SHARED)
+        {
+          __writeback(old + off, old + off + RISCV_PGSIZE);
+          __vmr_decref(v, 1);
+          *src = (*src & ~PTE_SHARED) | ((*src & PTE_W) ? PTE_D : 0);
+        }
+      }
+    }
+
+    *dst = *src;
+    *src = 0;
+  }
+
+  __flush_range(old, old + len);
+  __flush_range(new, new + len);
+  __reclaim_page_tables(old, old + len);
+}
+
+static uintptr_t __do_mremap(uintptr_t addr, size_t old_size, size_t new_size, int flags, uintptr_t new_addr)
+{
+  for (uintptr_t a = addr; a < addr + old_size; a += RISCV_PGSIZE)
+    if (__va_avail(a))
+      return -EFAULT;
+
+  if (flags & MREMAP_FIXED)
+  {
+    if ((new_addr & (RISCV_PGSIZE-1)) || !__valid_user_range(new_addr, new_size) ||
+        (new_addr < addr + old_size && addr < new_addr + new_size))
+      return -EINVAL;
+  }
+  else if (new_size <= old_size)
+  {
+    if (new_size < old_size)
+      __do_munmap(addr + new_size, old_size - new_size);
+    return addr;
+  }
+  else if (__valid_user_range(addr, new_size) &&
+           __range_avail(addr + old_size, new_size - old_size))
+  {
+    // grow in place
+    if (__mremap_extend(addr + old_size, addr + old_size, new_size - old_size))
+      return -ENOMEM;
+    return addr;
+  }
+  else if (!(flags & MREMAP_MAYMOVE) ||
+           !(new_addr = __vm_alloc(new_size / RISCV_PGSIZE)))
+    return -ENOMEM;
+
+  if (flags & MREMAP_FIXED)
+    __do_munmap(new_addr, new_size);
+
+  if (new_size < old_size)
+  {
+    __do_munmap(addr + new_size, old_size - new_size);
+    old_size = new_size;
+  }
+  else if (new_size > old_size &&
+           __mremap_extend(addr + old_size, new_addr + old_size, new_size - old_size))
+    return -ENOMEM;
+
+  __move_pages(addr, new_addr, old_size);
+  return new_addr;
+}
+
+uintptr_t do_mremap(uintptr_t addr, size_t old_size, size_t new_size, int flags, uintptr_t new_addr)
+{
+  if ((addr & (RISCV_PGSIZE-1)) || old_size == 0 || new_size == 0 ||
+      (flags & ~(MREMAP_MAYMOVE | MREMAP_FIXED)) ||
+      ((flags & MREMAP_FIXED) && !(flags & MREMAP_MAYMOVE)))
+    return -EINVAL;
+
+  old_size = ROUNDUP(old_size, RISCV_PGSIZE);
+  new_size = ROUNDUP(new_size, RISCV_PGSIZE);
+  if (!__valid_user_range(addr, old_size))
+    return -EFAULT;
+
+  spinlock_lock(&vm_lock);
+    addr = __do_mremap(addr, old_size, new_size, flags, new_addr);
+  spinlock_unlock(&vm_lock);
+
+  return addr;
+}
+
+// Fault in every pending page of [addr, addr + len).  Runs of pages from
+// the same VMR are populated together, so file-backed runs are read ahead
+// with a single pread.  It's only advice, so stop quietly when out of frames.
+static void __madvise_willneed(uintptr_t addr, size_t len)
+{
+  for (uintptr_t a = addr; a < addr + len; )
+  {
+    pte_t* pte = __walk(a);
+    if (pte == 0 || *pte == 0 || (*pte & PTE_V))
+    {
+      a += RISCV_PGSIZE;
+      continue;
+    }
+
+    vmr_t* v = (vmr_t*)*pte;
+    uintptr_t hi = a + RISCV_PGSIZE;
+    while (hi < addr + len && __vmr_page_pending(v, hi))
+      hi += RISCV_PGSIZE;
+
+    if (__populate_range(v, a, hi) != 0)
+      break;
+    a = hi;
+  }
+}
+
+// Release the frames behind the resident pages of [addr, addr + len) and
+// make them pending again.  Shared pages are written back and re-read from
+// their file; private anonymous ones come back zero-filled.  pk can't
+// re-read a private resident page that came from a file, so those stay
+// resident, as do the program's segments, which may have been copied from
+// a preloaded image, and pages that share preloaded frames or pk's own.
+static int __madvise_dontneed(uintptr_t addr, size_t len)
+{
+  vmr_t* zv = NULL;
+  int res = 0;
+
+  __writeback(addr, addr + len);
+
+  for (uintptr_t a = addr; a < addr + len; a += RISCV_PGSIZE)
+  {
+    pte_t* pte = __walk(a);
+    if (pte == 0 || !(*pte & PTE_V))
+      continue;
+
+    if (*pte & PTE_SHARED)
+    {
+      __frame_free(pte_ppn(*pte));
+      *pte = (pte_t)__shared_owner(a);
+      continue;
+    }
+
+    int prot = pte_prot(*pte);
+    vmr_t* v = __vmr_lookup(a);
+    if (!v || v->file || a < current.load_end || __preloaded(pte_ppn(*pte)))
+      continue;
+    if (v->prot != prot)
+    {
+      if (!zv || zv->prot != prot)
+        zv = __vmr_alloc(a, addr + len - a, NULL, 0, 0, prot);
+      if (!zv)
+      {
+        res = -EAGAIN;
+        break;
+      }
+      v = zv;
+    }
+
+    __frame_free(pte_ppn(*pte));
+    v->refcnt++;
+    *pte = (pte_t)v;
+  }
+
+  __flush_range(addr, addr + len);
+  return res;
+}
+
+static void __madvise_hint(uintptr_t addr, size_t len, int hint)
+{
+  for (uintptr_t a = addr; a < addr + len; a += RISCV_PGSIZE)
+  {
+    pte_t* pte = __walk(a);
+    if (pte && *pte && !(*pte & PTE_V))
+      ((vmr_t*)*pte)->hint = hint;
+  }
+}
+
+int do_madvise(uintptr_t addr, size_t length, int advice)
+{
+  if (addr & (RISCV_PGSIZE-1))
+    return -EINVAL;
+  length = ROUNDUP(length, RISCV_PGSIZE);
+  if (!__valid_user_range(addr, length))
+    return -ENOMEM;
+
+  int res = 0;
+  spinlock_lock(&vm_lock);
+    switch (advice)
+    {
+      case MADV_NORMAL:
+      case MADV_RANDOM:
+      case MADV_SEQUENTIAL:
+        break;
+      case MADV_WILLNEED:
+        __madvise_willneed(addr, length);
+        break;
+      case MADV_DONTNEED:
+        res = __madvise_dontneed(addr, length);
+        break;
+      case MADV_HUGEPAGE:
+        __madvise_hint(addr, length, VMR_HUGEPAGE);
+        break;
+      case MADV_NOHUGEPAGE:
+        __madvise_hint(addr, length, VMR_NOHUGEPAGE);
+        break;
+      default:
+        res = -EINVAL;
+    }
+  spinlock_unlock(&vm_lock);
+
+  return res;
+}
+
+int do_msync(uintptr_t addr, size_t length, int flags)
+{
+  if ((addr & (RISCV_PGSIZE-1)) || (flags & ~(MS_ASYNC | MS_INVALIDATE | MS_SYNC)) ||
+      (flags & (MS_ASYNC | MS_SYNC)) == (MS_ASYNC | MS_SYNC))
+    return -EINVAL;
+  length = ROUNDUP(length, RISCV_PGSIZE);
+  if (!__valid_user_range(addr, length))
+    return -ENOMEM;
+
+  // write-back is synchronous either way
+  spinlock_lock(&vm_lock);
+    __writeback(addr, addr + length);
+  spinlock_unlock(&vm_lock);
+
+  return 0;
+}
+
+// Keep I/O through file descriptors coherent with shared mappings of f.
+// Before [off, off + len) of f is read or written, dirty mapped pages of it
+// are written back; after it is written (drop != 0), resident mapped pages
+// of it are dropped, so the next touch reads the new data.
+void mmap_sync_file(file_t* f, off_t off, size_t len, int drop)
+{
+  if (!shared_vmrs)
+    return;
+
+  uintptr_t end = off + len < (uintptr_t)off ? -1UL : off + len;
+  spinlock_lock(&vm_lock);
+    for (vmr_t* v = vmrs; v < vmrs + MAX_VMR; v++)
+    {
+      if (!v->refcnt || !v->shared || v->file != f ||
+          end <= v->offset || v->offset + v->length <= off)
+        continue;
+
+      uintptr_t lo = v->addr + ROUNDDOWN(MAX((uintptr_t)off, v->offset) - v->offset, RISCV_PGSIZE);
+      uintptr_t hi = v->addr + ROUNDUP(MIN(end, v->offset + v->length) - v->offset, RISCV_PGSIZE);
+      if (!drop)
+      {
+        __writeback(lo, hi);
+        continue;
+      }
+
+      for (uintptr_t a = lo; a < hi; a += RISCV_PGSIZE)
+      {
+        pte_t* pte = __walk(a);
+        if (pte && (*pte & PTE_SHARED) && __shared_owner(a) == v)
+        {
+          __frame_free(pte_ppn(*pte));
+          *pte = (pte_t)v;
+        }
+      }
+      __flush_range(lo, hi);
+    }
+  spinlock_unlock(&vm_lock);
+}
+
+// Write back every shared mapping, e.g. at exit
+void mmap_sync_all()
 {
-  return -ENOSYS;
+  spinlock_lock(&vm_lock);
+    for (vmr_t* v = vmrs; shared_vmrs && v < vmrs + MAX_VMR; v++)
+      if (v->refcnt && v->shared)
+        __writeback(v->addr, v->addr + ROUNDUP(v->length, RISCV_PGSIZE));
+  spinlock_unlock(&vm_lock);
 }
 
 uintptr_t do_mprotect(uintptr_t addr, size_t length, int prot)
@@ -357,27 +1292,181 @@ uintptr_t do_mprotect(uintptr_t addr, size_t length, int prot)
           res = -EACCES;
           break;
         }
-        *pte = pte_create(pte_ppn(*pte), prot_to_type(prot, 1));
+        int shared = (*pte & PTE_SHARED) != 0;
+        *pte = pte_create(pte_ppn(*pte), user_type(prot, shared)) |
+               (shared ? *pte & PTE_D : 0);
       }
     }
+    __flush_range(addr, addr + length);
   spinlock_unlock(&vm_lock);
 
-  flush_tlb();
   return res;
 }
 
+// Map [vaddr, vaddr + len) to paddr globally, using megapages wherever
+// both sides are aligned, so the kernel takes few TLB entries.
 void __map_kernel_range(uintptr_t vaddr, uintptr_t paddr, size_t len, int prot)
 {
-  uintptr_t n = ROUNDUP(len, RISCV_PGSIZE) / RISCV_PGSIZE;
+  uintptr_t end = vaddr + ROUNDUP(len, RISCV_PGSIZE);
   uintptr_t offset = paddr - vaddr;
-  for (uintptr_t a = vaddr, i = 0; i < n; i++, a += RISCV_PGSIZE)
+  for (uintptr_t a = vaddr; a < end; )
   {
-    pte_t* pte = __walk_create(a);
+    int level = ((a | (a + offset)) & (MEGAPAGE_SIZE - 1)) == 0 &&
+                end - a >= MEGAPAGE_SIZE;
+    pte_t* pte = __walk_internal(a, 1, level);
     kassert(pte);
-    *pte = pte_create((a + offset) >> RISCV_PGSHIFT, prot_to_type(prot, 0));
+    *pte = pte_create((a + offset) >> RISCV_PGSHIFT, prot_to_type(prot, 0) | PTE_G);
+    a += level ? MEGAPAGE_SIZE : RISCV_PGSIZE;
   }
 }
 
+// Top the zero pool back up towards zero_pool_frames, one batch at a time,
+// starting just past the most recently allocated frame.  This only runs in
+// M-mode with translation off -- during pk_vm_init, and on the secondary
+// harts pk otherwise leaves stalled -- so frames are cleared through their
+// physical addresses.  That happens outside vm_lock, so the batch is marked
+// in use meanwhile.  Returns the number of frames zeroed.
+size_t refill_zero_pool()
+{
+  size_t batch[ZERO_BATCH], n = 0;
+
+  spinlock_lock(&vm_lock);
+    if (frame_map && zero_frames < zero_pool_frames)
+    {
+      for (size_t i = 0; i < frame_map_words && n < ZERO_BATCH; i++)
+      {
+        size_t w = (zero_cursor / FRAME_MAP_BITS + i) % frame_map_words;
+        for (uintptr_t avail = ~(frame_map[w] | zero_map[w]); avail && n < ZERO_BATCH; avail &= avail - 1)
+        {
+          size_t f = w * FRAME_MAP_BITS + __builtin_ctzl(avail);
+          frame_map[w] |= 1UL << (f % FRAME_MAP_BITS);
+          batch[n++] = f;
+        }
+      }
+    }
+  spinlock_unlock(&vm_lock);
+
+  for (size_t i = 0; i < n; i++)
+    __clear_pages(first_free_paddr + batch[i] * RISCV_PGSIZE, 1);
+
+  spinlock_lock(&vm_lock);
+    for (size_t i = 0; i < n; i++)
+    {
+      uintptr_t bit = 1UL << (batch[i] % FRAME_MAP_BITS);
+      frame_map[batch[i] / FRAME_MAP_BITS] &= ~bit;
+      zero_map[batch[i] / FRAME_MAP_BITS] |= bit;
+    }
+    zero_frames += n;
+  spinlock_unlock(&vm_lock);
+
+  return n;
+}
+
+// Whether the zero pool is enabled and short, read without vm_lock so the
+// idle harts don't contend for it just to find nothing to do.
+int zero_pool_short()
+{
+  return frame_map && zero_pool_frames && zero_frames < zero_pool_frames;
+}
+
+// Hand out npages contiguous, zeroed pages of the kernel's pool, which are
+// never given back, or 0 if there aren't that many left.
+uintptr_t kernel_page_alloc(size_t npages)
+{
+  uintptr_t res = 0;
+  spinlock_lock(&vm_lock);
+    if (npages && free_pages - next_free_page >= npages)
+    {
+      res = __page_alloc();
+      for (size_t i = 1; i < npages; i++)
+        __page_alloc();
+    }
+  spinlock_unlock(&vm_lock);
+  return res;
+}
+
+// Map [paddr, paddr + len) with prot for the kernel alone, and return the
+// address of paddr.  Memory inside pk is mapped where it is already;
+// anything else goes out of the user's reach: into the upper half of the
+// address space on RV64, or above pk on RV32, where the user never goes.
+// These windows don't survive pk_vm_set_mode.
+uintptr_t map_kernel_window(uintptr_t paddr, size_t len, int prot)
+{
+  static uintptr_t next_window;
+
+  if (kernel_va(paddr) && kernel_va(paddr + len - 1))
+    return paddr;
+
+  uintptr_t lo = ROUNDDOWN(paddr, RISCV_PGSIZE);
+  size_t size = ROUNDUP(paddr + len, RISCV_PGSIZE) - lo;
+  uintptr_t va;
+  spinlock_lock(&vm_lock);
+    if (!next_window)
+#if __riscv_xlen == 64
+      next_window = -(1UL << (RISCV_PGSHIFT + pt_levels * RISCV_PGLEVEL_BITS - 1));
+#else
+      next_window = ROUNDUP(first_free_paddr, MEGAPAGE_SIZE);
+#endif
+    // keep megapage alignment with paddr, so the window can use megapages
+    va = next_window + (lo & (MEGAPAGE_SIZE - 1));
+    __map_kernel_range(va, lo, size, prot);
+    next_window = ROUNDUP(va + size, MEGAPAGE_SIZE);
+    flush_tlb();
+  spinlock_unlock(&vm_lock);
+
+  return va + (paddr - lo);
+}
+
+// Map len bytes of the preloaded image from paddr on at vaddr, or wherever
+// there is room if vaddr is 0, sharing the image's pages.  Returns the
+// address used, or -1.
+uintptr_t map_image(uintptr_t vaddr, uintptr_t paddr, size_t len, int prot)
+{
+  kassert(!(paddr & (RISCV_PGSIZE-1)));
+  size_t npage = (len-1)/RISCV_PGSIZE+1;
+
+  spinlock_lock(&vm_lock);
+    if (vaddr == 0)
+      vaddr = __vm_alloc(npage);
+    else if ((vaddr & (RISCV_PGSIZE-1)) || !__valid_user_range(vaddr, len))
+      vaddr = 0;
+
+    if (vaddr)
+    {
+      __do_munmap(vaddr, npage * RISCV_PGSIZE);
+      for (size_t i = 0; i < npage; i++)
+      {
+        pte_t* pte = __walk_create(vaddr + i * RISCV_PGSIZE);
+        kassert(pte);
+        *pte = pte_create(ppn(paddr) + i, user_type(prot, 0));
+      }
+      __flush_range(vaddr, vaddr + npage * RISCV_PGSIZE);
+    }
+  spinlock_unlock(&vm_lock);
+
+  return vaddr ? vaddr : (uintptr_t)-1;
+}
+
+uintptr_t user_va2pa(uintptr_t va)
+{
+  pte_t* pte = __walk(va);
+  if (pte && (*pte & PTE_V))
+    return (pte_ppn(*pte) << RISCV_PGSHIFT) | (va & (RISCV_PGSIZE-1));
+  return va + first_free_paddr;
+}
+
+size_t pa_contig_len(uintptr_t va, size_t len)
+{
+  if (kernel_va(va))
+    return len;
+
+  uintptr_t pa = user_va2pa(va);
+  size_t n = MIN(len, RISCV_PGSIZE - (va & (RISCV_PGSIZE-1)));
+  while (n < len && user_va2pa(va + n) == pa + n)
+    n = MIN(len, n + RISCV_PGSIZE);
+  return n;
+}
+
 void populate_mapping(const void* start, size_t size, int prot)
 {
   uintptr_t a0 = ROUNDDOWN((uintptr_t)start, RISCV_PGSIZE);
@@ -390,30 +1479,147 @@ void populate_mapping(const void* start, size_t size, int prot)
   }
 }
 
+// Free the page tables under t, which is at the given level, and t itself.
+static void __pt_free_tree(pte_t* t, int level)
+{
+  for (size_t i = 0; level > 0 && i < RISCV_PGSIZE / sizeof(pte_t); i++)
+    if ((t[i] & PTE_V) && PTE_TABLE(t[i]))
+      __pt_free_tree((pte_t*)(pte_ppn(t[i]) << RISCV_PGSHIFT), level - 1);
+  __clear_pages((uintptr_t)t, 1);
+  __pt_free((uintptr_t)t);
+}
+
+// Switch to a fresh root page table in the given mode, holding only the
+// kernel's identity map.  satp ignores writes of modes the hart doesn't
+// implement, in which case this fails and the old tables stay in use.
+static int __vm_switch(uintptr_t mode)
+{
+  pte_t* old_root = root_page_table;
+  int old_levels = pt_levels;
+
+  pt_levels = satp_mode_levels(mode);
+  root_page_table = (void*)__pt_alloc();
+  __map_kernel_range(DRAM_BASE, DRAM_BASE, first_free_paddr - DRAM_BASE, PROT_READ|PROT_WRITE|PROT_EXEC);
+
+  // use ASID 1 for the user if the hart implements any ASID bits
+  uintptr_t satp = ((uintptr_t)root_page_table >> RISCV_PGSHIFT) | INSERT_FIELD(0, SATP_MODE, mode);
+  write_csr(sptbr, satp | SATP_ASID);
+  uintptr_t got = read_csr(sptbr);
+  if (EXTRACT_FIELD(got, SATP_MODE) != mode)
+  {
+    __pt_free_tree(root_page_table, pt_levels - 1);
+    root_page_table = old_root;
+    pt_levels = old_levels;
+    return -1;
+  }
+
+  user_asid = (got & SATP_ASID) ? 1 : 0;
+  flush_tlb();
+  write_csr(sptbr, INSERT_FIELD(satp, SATP_ASID, user_asid));
+  satp_mode = mode;
+  if (old_root)
+    __pt_free_tree(old_root, old_levels - 1);
+
+  // the user gets the lower half of the address space, less the kernel,
+  // but no more VA than there is memory for it.  When that doesn't all fit
+  // below the kernel, the heap starts above it (see load_elf), so the VA
+  // above the kernel alone covers all of memory.
+  uintptr_t user_top = 1UL << (RISCV_PGSHIFT + pt_levels * RISCV_PGLEVEL_BITS - 1);
+  size_t user_mem = mem_size - (first_free_paddr - DRAM_BASE);
+  if (user_mem > DRAM_BASE)
+    user_mem += first_free_paddr;
+  current.mmap_max = MIN(user_top, user_mem);
+  return 0;
+}
+
+static void __map_stack()
+{
+  size_t stack_size = MIN(STACK_INIT_SIZE, stack_rlimit);
+  stack_bottom = __do_mmap(current.mmap_max - stack_size, stack_size, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, 0, 0);
+  kassert(stack_bottom != (uintptr_t)-1);
+  current.stack_top = stack_bottom + stack_size;
+}
+
+// Move to Sv<bits> paging.  This must happen before the program is loaded,
+// since it rebuilds the address space with only the initial stack in it.
+int pk_vm_set_mode(int bits)
+{
+#if __riscv_xlen == 64
+  uintptr_t mode = bits == 39 ? SATP_MODE_SV39 : bits == 48 ? SATP_MODE_SV48 :
+                   bits == 57 ? SATP_MODE_SV57 : 0;
+#else
+  uintptr_t mode = bits == 32 ? SATP_MODE_SV32 : 0;
+#endif
+  if (mode == 0)
+    return -EINVAL;
+  if (mode == satp_mode)
+    return 0;
+
+  int ret;
+  spinlock_lock(&vm_lock);
+    __do_munmap(stack_bottom, current.stack_top - stack_bottom);
+    ret = __vm_switch(mode) ? -ENOTSUP : 0;
+    __map_stack();
+  spinlock_unlock(&vm_lock);
+  return ret;
+}
+
+// Set RLIMIT_STACK.  The hard limit may only come down.  The soft limit
+// is kept to at least what the stack already takes, so the gap
+// __mmap_base leaves below the stack never shrinks under it.
+int set_stack_rlimit(size_t soft, size_t hard)
+{
+  if (hard > stack_rlimit_max)
+    return -EPERM;
+
+  spinlock_lock(&vm_lock);
+    soft = MAX(soft, MAX(current.stack_top - stack_bottom, STACK_INIT_SIZE));
+    stack_rlimit = soft;
+    stack_rlimit_max = MAX(hard, soft);
+  spinlock_unlock(&vm_lock);
+  return 0;
+}
+
 uintptr_t pk_vm_init()
 {
-  // HTIF address signedness and va2pa macro both cap memory size to 2 GiB
+#if __riscv_xlen == 32
+  // HTIF addresses and the frame map can't reach past 2 GiB of memory
   mem_size = MIN(mem_size, 1U << 31);
+#endif
   size_t mem_pages = mem_size >> RISCV_PGSHIFT;
   free_pages = MAX(8, mem_pages >> (RISCV_PGLEVEL_BITS-1));
 
   extern char _end;
   first_free_page = ROUNDUP((uintptr_t)&_end, RISCV_PGSIZE);
   first_free_paddr = first_free_page + free_pages * RISCV_PGSIZE;
+  __check_outside_pool(image_start, image_end, "program");
+  __check_outside_pool(ramfs_start, ramfs_end, "archive");
+
+  user_frames = (mem_size - (first_free_paddr - DRAM_BASE)) >> RISCV_PGSHIFT;
+  frame_map_words = user_frames / FRAME_MAP_BITS + 1;
+  size_t map_pages = ROUNDUP(frame_map_words * sizeof(uintptr_t), RISCV_PGSIZE) / RISCV_PGSIZE;
+  // __page_alloc hands out consecutive pages, so each map is contiguous
+  uintptr_t* fmap = (uintptr_t*)__page_alloc();
+  for (size_t i = 1; i < 2 * map_pages; i++)
+    __page_alloc();
+  // mark the padding past the last frame as in use
+  fmap[user_frames / FRAME_MAP_BITS] = -1UL << (user_frames % FRAME_MAP_BITS);
+  // as are the frames of preloaded images, before any get zeroed
+  __reserve_frames(fmap, image_start, image_end);
+  __reserve_frames(fmap, ramfs_start, ramfs_end);
+
+  // secondary harts may already be waiting to fill the zero pool
+  spinlock_lock(&vm_lock);
+    zero_map = fmap + map_pages * (RISCV_PGSIZE / sizeof(uintptr_t));
+    frame_map = fmap;
+  spinlock_unlock(&vm_lock);
+  while (refill_zero_pool())
+    ;
 
-  root_page_table = (void*)__page_alloc();
-  __map_kernel_range(DRAM_BASE, DRAM_BASE, first_free_paddr - DRAM_BASE, PROT_READ|PROT_WRITE|PROT_EXEC);
-
-  current.mmap_max = current.brk_max =
-    MIN(DRAM_BASE, mem_size - (first_free_paddr - DRAM_BASE));
-
-  size_t stack_size = MIN(mem_pages >> 5, 2048) * RISCV_PGSIZE;
-  size_t stack_bottom = __do_mmap(current.mmap_max - stack_size, stack_size, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, 0, 0);
-  kassert(stack_bottom != (uintptr_t)-1);
-  current.stack_top = stack_bottom + stack_size;
+  kassert(__vm_switch(SATP_MODE_DEFAULT) == 0);
 
-  flush_tlb();
-  write_csr(sptbr, ((uintptr_t)root_page_table >> RISCV_PGSHIFT) | SATP_MODE_CHOICE);
+  stack_rlimit = MIN(mem_pages >> 5, 2048) * RISCV_PGSIZE;
+  __map_stack();
 
   uintptr_t kernel_stack_top = __page_alloc() + RISCV_PGSIZE;
   return kernel_stack_top;
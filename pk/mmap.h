@@ -15,27 +15,68 @@
 #define PROT_WRITE 2
 #define PROT_EXEC 4
 
+#define MAP_SHARED 0x1
 #define MAP_PRIVATE 0x2
 #define MAP_FIXED 0x10
 #define MAP_ANONYMOUS 0x20
 #define MAP_POPULATE 0x8000
+#define MREMAP_MAYMOVE 0x1
 #define MREMAP_FIXED 0x2
 
+#define MS_ASYNC 1
+#define MS_INVALIDATE 2
+#define MS_SYNC 4
+
+#define MADV_NORMAL 0
+#define MADV_RANDOM 1
+#define MADV_SEQUENTIAL 2
+#define MADV_WILLNEED 3
+#define MADV_DONTNEED 4
+#define MADV_HUGEPAGE 14
+#define MADV_NOHUGEPAGE 15
+
 extern int demand_paging;
+extern size_t fault_around_pages;
+extern size_t zero_pool_frames;
+extern size_t mmap_gap;
+extern size_t stack_rlimit;
+extern size_t stack_rlimit_max;
+extern int vm_bits;
+extern uintptr_t image_start, image_end;
+extern uintptr_t ramfs_start, ramfs_end;
+extern size_t rss_pages, peak_rss_pages;
+extern unsigned long minor_faults, major_faults;
 uintptr_t pk_vm_init();
+int pk_vm_set_mode(int bits);
+int set_stack_rlimit(size_t soft, size_t hard);
 int handle_page_fault(uintptr_t vaddr, int prot);
 void populate_mapping(const void* start, size_t size, int prot);
+size_t refill_zero_pool();
+int zero_pool_short();
 void __map_kernel_range(uintptr_t va, uintptr_t pa, size_t len, int prot);
 int __valid_user_range(uintptr_t vaddr, size_t len);
 uintptr_t __do_mmap(uintptr_t addr, size_t length, int prot, int flags, file_t* file, off_t offset);
 uintptr_t do_mmap(uintptr_t addr, size_t length, int prot, int flags, int fd, off_t offset);
 int do_munmap(uintptr_t addr, size_t length);
-uintptr_t do_mremap(uintptr_t addr, size_t old_size, size_t new_size, int flags);
+uintptr_t do_mremap(uintptr_t addr, size_t old_size, size_t new_size, int flags, uintptr_t new_addr);
 uintptr_t do_mprotect(uintptr_t addr, size_t length, int prot);
+int do_madvise(uintptr_t addr, size_t length, int advice);
+int do_msync(uintptr_t addr, size_t length, int flags);
+void mmap_sync_file(file_t* f, off_t off, size_t len, int drop);
+void mmap_sync_all();
 uintptr_t do_brk(uintptr_t addr);
+uintptr_t kernel_page_alloc(size_t npages);
+uintptr_t map_kernel_window(uintptr_t paddr, size_t len, int prot);
+uintptr_t map_image(uintptr_t vaddr, uintptr_t paddr, size_t len, int prot);
+uintptr_t user_va2pa(uintptr_t va);
+size_t pa_contig_len(uintptr_t va, size_t len);
+
+// pk itself is identity-mapped at [DRAM_BASE, first_free_paddr); user
+// mappings may lie on either side of it.
+extern uintptr_t first_free_paddr;
+#define kernel_va(va) ((uintptr_t)(va) - DRAM_BASE < first_free_paddr - DRAM_BASE)
 
 #define va2pa(va) ({ uintptr_t __va = (uintptr_t)(va); \
-  extern uintptr_t first_free_paddr; \
-  __va >= DRAM_BASE ? __va : __va + first_free_paddr; })
+  kernel_va(__va) ? __va : user_va2pa(__va); })
 
 #endif
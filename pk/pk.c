@@ -5,11 +5,19 @@
 #include "boot.h"
 #include "elf.h"
 #include "mtrap.h"
+#include "atomic.h"
 #include "frontend.h"
+#include "fdt.h"
+#include "syscall.h"
 #include <stdbool.h>
+#include <stdlib.h>
 
 elf_info current;
+uint64_t user_cycles, kernel_cycles; // charged by trap_entry
+uint64_t cycle_stamp; // cycle count at the last user/kernel transition
 long disabled_hart_mask;
+static const char* ramfs_prefix = "/ramfs";
+static const char* sd_prefix = NULL;
 
 static void help()
 {
@@ -19,6 +27,17 @@ static void help()
   printk("  -h, --help            Print this help message\n");
   printk("  -p                    Disable on-demand program paging\n");
   printk("  -s                    Print cycles upon termination\n");
+  printk("  --fault-around=N      Map up to N pages per anonymous page fault\n");
+  printk("                        (default %d; 1 disables fault-around)\n", (int)fault_around_pages);
+  printk("  --zero-pool=N         Keep up to N free pages zeroed ahead of faults\n");
+  printk("                        (default %d; 0 disables refills)\n", (int)zero_pool_frames);
+  printk("  --mmap-gap=N          Start mmaps N MiB below the stack limit (default %d)\n", (int)(mmap_gap >> 20));
+  printk("  --stack-limit=N       Let the stack grow to N KiB (default %d)\n", (int)(stack_rlimit >> 10));
+#if __riscv_xlen == 64
+  printk("  --vm=svN              Use Sv39, Sv48 or Sv57 paging (default Sv39)\n");
+#endif
+  printk("  --ramfs=PATH          Serve the preloaded archive under PATH (default %s)\n", ramfs_prefix);
+  printk("  --sd=PATH             Serve the SD card's ext2 filesystem under PATH\n");
 
   shutdown(0);
 }
@@ -46,6 +65,45 @@ static void handle_option(const char* arg)
     return;
   }
 
+  if (strncmp(arg, "--fault-around=", 15) == 0) { // pages per anon fault
+    long n = atol(arg + 15);
+    fault_around_pages = n > 1 ? n : 1;
+    return;
+  }
+
+  if (strncmp(arg, "--zero-pool=", 12) == 0) { // pre-zeroed free pages
+    long n = atol(arg + 12);
+    zero_pool_frames = n > 0 ? n : 0;
+    return;
+  }
+
+  if (strncmp(arg, "--mmap-gap=", 11) == 0) { // MiB between stack and mmaps
+    long n = atol(arg + 11);
+    mmap_gap = (n > 0 ? n : 0) << 20;
+    return;
+  }
+
+  if (strncmp(arg, "--stack-limit=", 14) == 0) { // RLIMIT_STACK, in KiB
+    long n = atol(arg + 14);
+    set_stack_rlimit((n > 0 ? n : 0) << 10, stack_rlimit_max);
+    return;
+  }
+
+  if (strncmp(arg, "--vm=sv", 7) == 0) { // paging mode
+    vm_bits = atol(arg + 7);
+    return;
+  }
+
+  if (strncmp(arg, "--ramfs=", 8) == 0) { // where the archive is mounted
+    ramfs_prefix = arg + 8;
+    return;
+  }
+
+  if (strncmp(arg, "--sd=", 5) == 0) { // where the SD card is mounted
+    sd_prefix = arg + 5;
+    return;
+  }
+
   panic("unrecognized option: `%s'", arg);
   suggest_help();
 }
@@ -112,6 +170,8 @@ static void run_loaded_program(size_t argc, char** argv, uintptr_t kstack_top)
   // align stack
   stack_top &= -sizeof(void*);
 
+  clock_init();
+
   struct {
     long key;
     long value;
@@ -123,6 +183,7 @@ static void run_loaded_program(size_t argc, char** argv, uintptr_t kstack_top)
     {AT_PAGESZ, RISCV_PGSIZE},
     {AT_SECURE, 0},
     {AT_RANDOM, stack_top},
+    {AT_SYSINFO_EHDR, map_vdso()},
     {AT_NULL, 0}
   };
 
@@ -162,6 +223,7 @@ static void run_loaded_program(size_t argc, char** argv, uintptr_t kstack_top)
   init_tf(&tf, current.entry, stack_top);
   __clear_cache(0, 0);
   write_csr(sscratch, kstack_top);
+  cycle_stamp = rdcycle64();
   start_user(&tf);
 }
 
@@ -172,6 +234,16 @@ static void rest_of_boot_loader(uintptr_t kstack_top)
   if (!argc)
     panic("tell me what ELF to load!");
 
+  if (vm_bits && pk_vm_set_mode(vm_bits) != 0)
+    panic("Sv%d paging is not available", vm_bits);
+
+  if (ramfs_end > ramfs_start && ramfs_mount(ramfs_prefix) != 0)
+    panic("couldn't mount the preloaded archive at %s", ramfs_prefix);
+
+  // probing the SD card can take a while, so only do it if asked to
+  if (sd_prefix && ext2_mount(sd_prefix) != 0)
+    panic("couldn't mount the SD card at %s", sd_prefix);
+
   // load program named by argv[0]
   long phdrs[128];
   current.phdr = (uintptr_t)phdrs;
@@ -189,13 +261,41 @@ void boot_loader(uintptr_t dtb)
   write_csr(sie, 0);
   set_csr(sstatus, SSTATUS_SUM | SSTATUS_FS);
 
+  // a program preloaded by the platform, or linked into pk, is loaded
+  // from memory rather than read through the host
+  extern char _image_start, _image_end;
+  if (kernel_start && kernel_end) {
+    image_start = (uintptr_t)kernel_start;
+    image_end = (uintptr_t)kernel_end;
+  } else {
+    image_start = (uintptr_t)&_image_start;
+    image_end = (uintptr_t)&_image_end;
+  }
+
+  // likewise an archive of files, handed over as an initrd or linked in
+  extern char _ramfs_start, _ramfs_end;
+  if (initrd_start && initrd_end) {
+    ramfs_start = (uintptr_t)initrd_start;
+    ramfs_end = (uintptr_t)initrd_end;
+  } else {
+    ramfs_start = (uintptr_t)&_ramfs_start;
+    ramfs_end = (uintptr_t)&_ramfs_end;
+  }
+
   file_init();
   enter_supervisor_mode(rest_of_boot_loader, pk_vm_init(), 0);
 }
 
 void boot_other_hart(uintptr_t dtb)
 {
-  // stall all harts besides hart 0
+  // stall all harts besides hart 0, but have them keep the zero pool
+  // topped up: hart 0 interrupts them when it drains to its low-water mark
   while (1)
-    wfi();
+  {
+    *HLS()->ipi = 0;
+    HLS()->mipi_pending = 0;
+    mb();
+    if (!zero_pool_short() || !refill_zero_pool())
+      wfi();
+  }
 }
@@ -34,6 +34,7 @@ void printm(const char* s, ...);
 int vsnprintf(char* out, size_t n, const char* s, va_list vl);
 int snprintf(char* out, size_t n, const char* s, ...);
 void start_user(trapframe_t* tf) __attribute__((noreturn));
+extern uint64_t user_cycles, kernel_cycles, cycle_stamp;
 void dump_tf(trapframe_t*);
 
 static inline int insn_len(long insn)
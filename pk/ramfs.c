@@ -0,0 +1,231 @@
+// See LICENSE for license details.
+
+#include "file.h"
+#include "mmap.h"
+#include "pk.h"
+#include "bits.h"
+#include <string.h>
+#include <errno.h>
+
+// A ustar archive preloaded into memory, served read-only under a path
+// prefix.  It is indexed once, into a hash table of normalized paths, so
+// lookups don't walk the archive, and reads copy straight out of it.
+
+#define TAR_BLOCK 512
+#define TAR_NAME 0
+#define TAR_MODE 100
+#define TAR_SIZE 124
+#define TAR_TYPE 156
+#define TAR_MAGIC 257
+#define TAR_PREFIX 345
+
+struct fs_node
+{
+  const char* name; // normalized: no leading "./" or "/", no trailing "/"
+  uint32_t hash;
+  uint32_t mode;
+  const char* data;
+  size_t size;
+};
+
+static uintptr_t archive; // where the kernel sees it
+static struct fs_node* nodes;
+static size_t nodes_mask; // the table has nodes_mask + 1 slots
+static struct fs_node root = { "", 0, S_IFDIR | 0555, NULL, 0 };
+
+static uint32_t hash_name(const char* s, size_t len)
+{
+  uint32_t h = 2166136261U;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ (unsigned char)s[i]) * 16777619U;
+  return h;
+}
+
+// Strip a leading "./" or "/", and trailing "/"s; returns the length left.
+static size_t normalize(const char** s, size_t len)
+{
+  while (len > 0 && (**s == '/' || (len > 1 && (*s)[0] == '.' && (*s)[1] == '/')))
+  {
+    size_t skip = **s == '/' ? 1 : 2;
+    *s += skip;
+    len -= skip;
+  }
+  while (len > 0 && (*s)[len-1] == '/')
+    len--;
+  return len;
+}
+
+static size_t tar_octal(const char* p, size_t n)
+{
+  size_t v = 0, i = 0;
+  while (i < n && p[i] == ' ')
+    i++;
+  for ( ; i < n && p[i] >= '0' && p[i] <= '7'; i++)
+    v = v * 8 + (p[i] - '0');
+  return v;
+}
+
+// Header fields are NUL-terminated only when shorter than the field
+static size_t field_len(const char* p, size_t n)
+{
+  size_t len = 0;
+  while (len < n && p[len])
+    len++;
+  return len;
+}
+
+// The full path of the entry at h, before normalizing, into buf
+static size_t tar_path(const char* h, char* buf)
+{
+  size_t len = 0;
+  if (strncmp(h + TAR_MAGIC, "ustar", 5) == 0 && h[TAR_PREFIX])
+  {
+    len = field_len(h + TAR_PREFIX, 155);
+    memcpy(buf, h + TAR_PREFIX, len);
+    buf[len++] = '/';
+  }
+  size_t name_len = field_len(h + TAR_NAME, 100);
+  memcpy(buf + len, h + TAR_NAME, name_len);
+  return len + name_len;
+}
+
+// Call fn on each regular file and directory in the archive
+static void tar_walk(void (*fn)(const char* h, const char* name, size_t len, void* arg), void* arg)
+{
+  size_t size = ramfs_end - ramfs_start;
+  for (size_t off = 0; off + TAR_BLOCK <= size; )
+  {
+    const char* h = (const char*)archive + off;
+    if (h[TAR_NAME] == '\0')
+      break;
+
+    size_t data_size = tar_octal(h + TAR_SIZE, 12);
+    char type = h[TAR_TYPE];
+    if (type == '0' || type == '\0' || type == '7' || type == '5')
+    {
+      char buf[256 + 1];
+      const char* name = buf;
+      size_t len = normalize(&name, tar_path(h, buf));
+      if (len > 0 && off + TAR_BLOCK + data_size <= size)
+        fn(h, name, len, arg);
+    }
+
+    off += TAR_BLOCK + ROUNDUP(data_size, TAR_BLOCK);
+  }
+}
+
+static struct fs_node* find_slot(const char* name, size_t len, uint32_t hash)
+{
+  for (size_t i = hash & nodes_mask; ; i = (i + 1) & nodes_mask)
+  {
+    struct fs_node* n = &nodes[i];
+    if (!n->name || (n->hash == hash && strncmp(n->name, name, len) == 0 && n->name[len] == '\0'))
+      return n;
+  }
+}
+
+static void count_entry(const char* h, const char* name, size_t len, void* arg)
+{
+  size_t* counts = arg;
+  counts[0]++;
+  counts[1] += len + 1;
+}
+
+static void add_entry(const char* h, const char* name, size_t len, void* arg)
+{
+  char** strings = arg;
+  uint32_t hash = hash_name(name, len);
+  struct fs_node* n = find_slot(name, len, hash);
+
+  // a later entry for the same path replaces the earlier one
+  if (!n->name)
+  {
+    memcpy(*strings, name, len);
+    n->name = *strings;
+    *strings += len + 1;
+  }
+  n->hash = hash;
+  n->mode = (tar_octal(h + TAR_MODE, 8) & 07777) | (h[TAR_TYPE] == '5' ? S_IFDIR : S_IFREG);
+  n->data = h + TAR_BLOCK;
+  n->size = S_ISDIR(n->mode) ? 0 : tar_octal(h + TAR_SIZE, 12);
+}
+
+static fs_node_t* ramfs_lookup(const char* path)
+{
+  size_t len = normalize(&path, strlen(path));
+  if (len == 0)
+    return &root;
+
+  struct fs_node* n = find_slot(path, len, hash_name(path, len));
+  return n->name ? n : NULL;
+}
+
+static ssize_t ramfs_pread(fs_node_t* node, void* buf, size_t n, off_t off)
+{
+  if (S_ISDIR(node->mode))
+    return -EISDIR;
+  if (off < 0)
+    return -EINVAL;
+  if (off >= node->size)
+    return 0;
+
+  n = MIN(n, node->size - off);
+  memcpy(buf, node->data + off, n);
+  return n;
+}
+
+static void ramfs_stat(fs_node_t* node, struct stat* s)
+{
+  memset(s, 0, sizeof(*s));
+  s->st_ino = node == &root ? 1 : node - nodes + 2;
+  s->st_mode = node->mode;
+  s->st_nlink = 1;
+  s->st_size = node->size;
+  s->st_blksize = RISCV_PGSIZE;
+  s->st_blocks = (node->size + 511) / 512;
+}
+
+// Only whole pages inside the file can be lent out; the page holding its
+// end also holds whatever follows it in the archive.
+static uintptr_t ramfs_page(fs_node_t* node, off_t off)
+{
+  uintptr_t p = (uintptr_t)node->data + off;
+  if (S_ISDIR(node->mode) || off < 0 || off + RISCV_PGSIZE > node->size ||
+      (p & (RISCV_PGSIZE-1)))
+    return 0;
+  return ramfs_start + (p - archive);
+}
+
+static const fs_t ramfs = {
+  .lookup = ramfs_lookup,
+  .pread = ramfs_pread,
+  .stat = ramfs_stat,
+  .page = ramfs_page,
+};
+
+int ramfs_mount(const char* prefix)
+{
+  archive = map_kernel_window(ramfs_start, ramfs_end - ramfs_start, PROT_READ);
+
+  size_t counts[2] = {0, 0};
+  tar_walk(count_entry, counts);
+
+  size_t slots = 1;
+  while (slots < 2 * counts[0])
+    slots *= 2;
+  size_t prefix_size = strlen(prefix) + 1;
+  size_t table_size = slots * sizeof(struct fs_node);
+  size_t size = table_size + counts[1] + prefix_size;
+  uintptr_t mem = kernel_page_alloc(ROUNDUP(size, RISCV_PGSIZE) / RISCV_PGSIZE);
+  if (!mem)
+    return -ENOMEM;
+
+  nodes = (struct fs_node*)mem;
+  nodes_mask = slots - 1;
+  char* strings = (char*)mem + table_size;
+  tar_walk(add_entry, &strings);
+
+  // the prefix may live on a stack that's about to be reused
+  memcpy(strings, prefix, prefix_size);
+  return fs_mount(strings, &ramfs);
+}
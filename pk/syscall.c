@@ -6,13 +6,14 @@
 #include "frontend.h"
 #include "mmap.h"
 #include "boot.h"
+#include "bits.h"
+#include "vdso.h"
+#include "fdt.h"
 #include <string.h>
 #include <errno.h>
 
 typedef long (*syscall_t)(long, long, long, long, long, long, long);
 
-#define CLOCK_FREQ 1000000000
-
 void sys_exit(int code)
 {
   if (current.cycle0) {
@@ -23,9 +24,14 @@ void sys_exit(int code)
     printk("%lld ticks\n", dt);
     printk("%lld cycles\n", dc);
     printk("%lld instructions\n", di);
+    printk("%lld user cycles, %lld kernel cycles\n", user_cycles,
+        kernel_cycles + (rdcycle64() - cycle_stamp));
+    printk("%ld minor faults, %ld major faults, %ld KiB peak RSS\n",
+        minor_faults, major_faults, (long)(peak_rss_pages * (RISCV_PGSIZE / 1024)));
     printk("%d.%d%d CPI\n", (int)(dc/di), (int)(10ULL*dc/di % 10),
         (int)((100ULL*dc + di/2)/di % 10));
   }
+  mmap_sync_all();
   shutdown(code);
 }
 
@@ -36,6 +42,7 @@ ssize_t sys_read(int fd, char* buf, size_t n)
 
   if (f)
   {
+    mmap_sync_file(f, 0, -1, 0);
     r = file_read(f, buf, n);
     file_decref(f);
   }
@@ -50,6 +57,7 @@ ssize_t sys_pread(int fd, char* buf, size_t n, off_t offset)
 
   if (f)
   {
+    mmap_sync_file(f, offset, n, 0);
     r = file_pread(f, buf, n, offset);
     file_decref(f);
   }
@@ -64,7 +72,25 @@ ssize_t sys_write(int fd, const char* buf, size_t n)
 
   if (f)
   {
+    mmap_sync_file(f, 0, -1, 0);
     r = file_write(f, buf, n);
+    mmap_sync_file(f, 0, -1, 1);
+    file_decref(f);
+  }
+
+  return r;
+}
+
+ssize_t sys_pwrite(int fd, const char* buf, size_t n, off_t offset)
+{
+  ssize_t r = -EBADF;
+  file_t* f = file_get(fd);
+
+  if (f)
+  {
+    mmap_sync_file(f, offset, n, 0);
+    r = file_pwrite(f, buf, n, offset);
+    mmap_sync_file(f, offset, n, 1);
     file_decref(f);
   }
 
@@ -210,8 +236,25 @@ ssize_t sys_lseek(int fd, size_t ptr, int dir)
   return r;
 }
 
+// Stat name if a filesystem in pk serves it; 1 means the host does.
+static long fs_stat(int dirfd, const char* name, void* st)
+{
+  fs_node_t* node;
+  const fs_t* fs = fs_resolve(dirfd, name, &node);
+  if (!fs)
+    return 1;
+  if (!node)
+    return -ENOENT;
+  fs->stat(node, st);
+  return 0;
+}
+
 long sys_lstat(const char* name, void* st)
 {
+  long r = fs_stat(AT_FDCWD, name, st);
+  if (r != 1)
+    return r;
+
   struct frontend_stat buf;
   size_t name_size = strlen(name)+1;
   long ret = frontend_syscall(SYS_lstat, va2pa(name), name_size, va2pa(&buf), 0, 0, 0, 0);
@@ -221,6 +264,10 @@ long sys_lstat(const char* name, void* st)
 
 long sys_fstatat(int dirfd, const char* name, void* st, int flags)
 {
+  long r = fs_stat(dirfd, name, st);
+  if (r != 1)
+    return r;
+
   int kfd = at_kfd(dirfd);
   if (kfd != -1) {
     struct frontend_stat buf;
@@ -239,6 +286,10 @@ long sys_stat(const char* name, void* st)
 
 long sys_faccessat(int dirfd, const char *name, int mode)
 {
+  fs_node_t* node;
+  if (fs_resolve(dirfd, name, &node))
+    return !node ? -ENOENT : (mode & W_OK) ? -EROFS : 0;
+
   int kfd = at_kfd(dirfd);
   if (kfd != -1) {
     size_t name_size = strlen(name)+1;
@@ -349,9 +400,9 @@ int sys_munmap(uintptr_t addr, size_t length)
   return do_munmap(addr, length);
 }
 
-uintptr_t sys_mremap(uintptr_t addr, size_t old_size, size_t new_size, int flags)
+uintptr_t sys_mremap(uintptr_t addr, size_t old_size, size_t new_size, int flags, uintptr_t new_addr)
 {
-  return do_mremap(addr, old_size, new_size, flags);
+  return do_mremap(addr, old_size, new_size, flags, new_addr);
 }
 
 uintptr_t sys_mprotect(uintptr_t addr, size_t length, int prot)
@@ -359,6 +410,86 @@ uintptr_t sys_mprotect(uintptr_t addr, size_t length, int prot)
   return do_mprotect(addr, length, prot);
 }
 
+int sys_madvise(uintptr_t addr, size_t length, int advice)
+{
+  return do_madvise(addr, length, advice);
+}
+
+int sys_msync(uintptr_t addr, size_t length, int flags)
+{
+  return do_msync(addr, length, flags);
+}
+
+#define RLIMIT_STACK 3
+#define RLIM_NLIMITS 16
+#define RLIM_INFINITY (-1ULL)
+
+static uint64_t rlim_from_size(size_t x)
+{
+  return x == (size_t)-1 ? RLIM_INFINITY : x;
+}
+
+// Only RLIMIT_STACK is enforced.  The other limits read as unlimited, and
+// setting them is accepted but has no effect.
+static long do_prlimit(int resource, const uint64_t* new_limit, uint64_t* old_limit)
+{
+  if (resource < 0 || resource >= RLIM_NLIMITS)
+    return -EINVAL;
+  if (new_limit && new_limit[0] > new_limit[1])
+    return -EINVAL;
+
+  if (old_limit)
+  {
+    old_limit[0] = old_limit[1] = RLIM_INFINITY;
+    if (resource == RLIMIT_STACK)
+    {
+      old_limit[0] = rlim_from_size(stack_rlimit);
+      old_limit[1] = rlim_from_size(stack_rlimit_max);
+    }
+  }
+
+  if (new_limit && resource == RLIMIT_STACK)
+    return set_stack_rlimit(MIN(new_limit[0], (size_t)-1), MIN(new_limit[1], (size_t)-1));
+
+  return 0;
+}
+
+long sys_prlimit64(int pid, int resource, const uint64_t* new_limit, uint64_t* old_limit)
+{
+  if (pid != 0 && pid != sys_getpid())
+    return -ESRCH;
+
+  uint64_t new_buf[2], old_buf[2];
+  if (new_limit)
+    memcpy(new_buf, new_limit, sizeof(new_buf));
+
+  long ret = do_prlimit(resource, new_limit ? new_buf : NULL, old_limit ? old_buf : NULL);
+  if (ret == 0 && old_limit)
+    memcpy(old_limit, old_buf, sizeof(old_buf));
+  return ret;
+}
+
+long sys_getrlimit(int resource, unsigned long* rlim)
+{
+  uint64_t buf[2];
+  long ret = do_prlimit(resource, NULL, buf);
+  if (ret == 0)
+  {
+    rlim[0] = MIN(buf[0], -1UL);
+    rlim[1] = MIN(buf[1], -1UL);
+  }
+  return ret;
+}
+
+long sys_setrlimit(int resource, const unsigned long* rlim)
+{
+  uint64_t buf[2] = {
+    rlim[0] == -1UL ? RLIM_INFINITY : rlim[0],
+    rlim[1] == -1UL ? RLIM_INFINITY : rlim[1],
+  };
+  return do_prlimit(resource, buf, NULL);
+}
+
 int sys_rt_sigaction(int sig, const void* act, void* oact, size_t sssz)
 {
   if (oact)
@@ -367,44 +498,142 @@ int sys_rt_sigaction(int sig, const void* act, void* oact, size_t sssz)
   return 0;
 }
 
+#define DEFAULT_TIMEBASE 10000000 // Spike's, if the device tree has none
+
+static struct vdso_data timebase;
+
+// Work out the clocks' scale from the device tree, and start the program's
+// CPU clock.
+void clock_init()
+{
+  uint64_t freq = timebase_freq ? timebase_freq : DEFAULT_TIMEBASE;
+  timebase.ns_mult = ((NSEC_PER_SEC << 32) + freq / 2) / freq;
+  timebase.res_ns = (NSEC_PER_SEC + freq - 1) / freq;
+  timebase.start_ticks = rdtime64();
+}
+
 long sys_time(long* loc)
 {
-  uint64_t t = rdcycle64() / CLOCK_FREQ;
+  long ts[2];
+  ns_to_timespec(clock_ns(&timebase, CLOCK_REALTIME, rdtime64()), ts);
   if (loc)
-    *loc = t;
-  return t;
+    *loc = ts[0];
+  return ts[0];
+}
+
+// User and kernel cycles so far, counting the kernel's time in the
+// current syscall up to now.
+static void cpu_cycles(uint64_t* user, uint64_t* kernel)
+{
+  *user = user_cycles;
+  *kernel = kernel_cycles + (rdcycle64() - cycle_stamp);
+}
+
+// The program's CPU time in ns, split between user and kernel in the
+// proportion of the cycles each has had.
+static void cpu_time(uint64_t* user, uint64_t* kernel)
+{
+  uint64_t u, k;
+  cpu_cycles(&u, &k);
+  uint64_t ns = clock_ns(&timebase, CLOCK_PROCESS_CPUTIME_ID, rdtime64());
+
+  // keep ns * k from overflowing
+  while ((u | k) >> 16) {
+    u >>= 1;
+    k >>= 1;
+  }
+  *kernel = u + k ? ns * k / (u + k) : 0;
+  *user = ns - *kernel;
 }
 
 int sys_times(long* loc)
 {
-  uint64_t t = rdcycle64();
-  kassert(CLOCK_FREQ % 1000000 == 0);
-  loc[0] = t / (CLOCK_FREQ / 1000000);
-  loc[1] = 0;
+  uint64_t u, k;
+  cpu_time(&u, &k);
+  loc[0] = u / 1000;
+  loc[1] = k / 1000;
   loc[2] = 0;
   loc[3] = 0;
   
+  return clock_ns(&timebase, CLOCK_MONOTONIC, rdtime64()) / 1000;
+}
+
+#define RUSAGE_SELF 0
+#define RUSAGE_CHILDREN (-1)
+#define RUSAGE_THREAD 1
+#define RUSAGE_WORDS 18 // two timevals, then 14 longs
+
+long sys_getrusage(int who, long* loc)
+{
+  if (who != RUSAGE_SELF && who != RUSAGE_CHILDREN && who != RUSAGE_THREAD)
+    return -EINVAL;
+
+  memset(loc, 0, RUSAGE_WORDS * sizeof(long));
+  if (who == RUSAGE_CHILDREN)
+    return 0;
+
+  uint64_t u, k;
+  cpu_time(&u, &k);
+  ns_to_timespec(u, &loc[0]);
+  ns_to_timespec(k, &loc[2]);
+  loc[1] /= 1000;
+  loc[3] /= 1000;
+  loc[4] = peak_rss_pages * (RISCV_PGSIZE / 1024); // ru_maxrss, in KiB
+  loc[8] = minor_faults; // ru_minflt
+  loc[9] = major_faults; // ru_majflt
+
   return 0;
 }
 
 int sys_gettimeofday(long* loc)
 {
-  uint64_t t = rdcycle64();
-  loc[0] = t / CLOCK_FREQ;
-  loc[1] = (t % CLOCK_FREQ) / (CLOCK_FREQ / 1000000);
+  ns_to_timespec(clock_ns(&timebase, CLOCK_REALTIME, rdtime64()), loc);
+  loc[1] /= 1000;
   
   return 0;
 }
 
 long sys_clock_gettime(int clk_id, long *loc)
 {
-  uint64_t t = rdcycle64();
-  loc[0] = t / CLOCK_FREQ;
-  loc[1] = (t % CLOCK_FREQ) / (CLOCK_FREQ / 1000000000);
+  int64_t ns = clock_ns(&timebase, clk_id, rdtime64());
+  if (ns < 0)
+    return -EINVAL;
+  ns_to_timespec(ns, loc);
+
+  return 0;
+}
+
+long sys_clock_getres(int clk_id, long *loc)
+{
+  if (clock_ns(&timebase, clk_id, 0) < 0)
+    return -EINVAL;
+  if (loc) {
+    loc[0] = 0;
+    loc[1] = timebase.res_ns;
+  }
 
   return 0;
 }
 
+// Map the vDSO, and the page of data it reads just below it, into the
+// program.  Returns the vDSO's address, or 0 if there isn't one.
+uintptr_t map_vdso()
+{
+  extern char _vdso_data_page, _vdso_start, _vdso_end;
+  size_t size = &_vdso_end - &_vdso_start;
+  if (size == 0)
+    return 0;
+
+  struct vdso_data* data = (struct vdso_data*)&_vdso_data_page;
+  *data = timebase;
+
+  uintptr_t base = map_image(0, (uintptr_t)data, RISCV_PGSIZE + size, PROT_READ | PROT_EXEC);
+  if (base == (uintptr_t)-1)
+    return 0;
+  map_image(base, (uintptr_t)data, RISCV_PGSIZE, PROT_READ);
+  return base + RISCV_PGSIZE;
+}
+
 ssize_t sys_writev(int fd, const long* iov, int cnt)
 {
   ssize_t ret = 0;
@@ -438,59 +667,64 @@ static int sys_stub_nosys()
   return -ENOSYS;
 }
 
+// Indexed by syscall number; trap_entry dispatches through it directly
+const void* const syscall_table[] = {
+  [SYS_exit] = sys_exit,
+  [SYS_exit_group] = sys_exit,
+  [SYS_read] = sys_read,
+  [SYS_pread] = sys_pread,
+  [SYS_write] = sys_write,
+  [SYS_pwrite] = sys_pwrite,
+  [SYS_openat] = sys_openat,
+  [SYS_close] = sys_close,
+  [SYS_fstat] = sys_fstat,
+  [SYS_lseek] = sys_lseek,
+  [SYS_fstatat] = sys_fstatat,
+  [SYS_linkat] = sys_linkat,
+  [SYS_unlinkat] = sys_unlinkat,
+  [SYS_mkdirat] = sys_mkdirat,
+  [SYS_renameat] = sys_renameat,
+  [SYS_getcwd] = sys_getcwd,
+  [SYS_brk] = sys_brk,
+  [SYS_uname] = sys_uname,
+  [SYS_getpid] = sys_getpid,
+  [SYS_getuid] = sys_getuid,
+  [SYS_geteuid] = sys_getuid,
+  [SYS_getgid] = sys_getuid,
+  [SYS_getegid] = sys_getuid,
+  [SYS_mmap] = sys_mmap,
+  [SYS_munmap] = sys_munmap,
+  [SYS_mremap] = sys_mremap,
+  [SYS_mprotect] = sys_mprotect,
+  [SYS_prlimit64] = sys_prlimit64,
+  [SYS_rt_sigaction] = sys_rt_sigaction,
+  [SYS_gettimeofday] = sys_gettimeofday,
+  [SYS_times] = sys_times,
+  [SYS_writev] = sys_writev,
+  [SYS_faccessat] = sys_faccessat,
+  [SYS_fcntl] = sys_fcntl,
+  [SYS_ftruncate] = sys_ftruncate,
+  [SYS_getdents] = sys_getdents,
+  [SYS_dup] = sys_dup,
+  [SYS_dup3] = sys_dup3,
+  [SYS_readlinkat] = sys_stub_nosys,
+  [SYS_rt_sigprocmask] = sys_stub_success,
+  [SYS_ioctl] = sys_stub_nosys,
+  [SYS_clock_gettime] = sys_clock_gettime,
+  [SYS_clock_getres] = sys_clock_getres,
+  [SYS_getrusage] = sys_getrusage,
+  [SYS_getrlimit] = sys_getrlimit,
+  [SYS_setrlimit] = sys_setrlimit,
+  [SYS_chdir] = sys_chdir,
+  [SYS_set_tid_address] = sys_stub_nosys,
+  [SYS_set_robust_list] = sys_stub_nosys,
+  [SYS_madvise] = sys_madvise,
+  [SYS_msync] = sys_msync,
+};
+const size_t nr_syscalls = ARRAY_SIZE(syscall_table);
+
 long do_syscall(long a0, long a1, long a2, long a3, long a4, long a5, unsigned long n)
 {
-  const static void* syscall_table[] = {
-    [SYS_exit] = sys_exit,
-    [SYS_exit_group] = sys_exit,
-    [SYS_read] = sys_read,
-    [SYS_pread] = sys_pread,
-    [SYS_write] = sys_write,
-    [SYS_openat] = sys_openat,
-    [SYS_close] = sys_close,
-    [SYS_fstat] = sys_fstat,
-    [SYS_lseek] = sys_lseek,
-    [SYS_fstatat] = sys_fstatat,
-    [SYS_linkat] = sys_linkat,
-    [SYS_unlinkat] = sys_unlinkat,
-    [SYS_mkdirat] = sys_mkdirat,
-    [SYS_renameat] = sys_renameat,
-    [SYS_getcwd] = sys_getcwd,
-    [SYS_brk] = sys_brk,
-    [SYS_uname] = sys_uname,
-    [SYS_getpid] = sys_getpid,
-    [SYS_getuid] = sys_getuid,
-    [SYS_geteuid] = sys_getuid,
-    [SYS_getgid] = sys_getuid,
-    [SYS_getegid] = sys_getuid,
-    [SYS_mmap] = sys_mmap,
-    [SYS_munmap] = sys_munmap,
-    [SYS_mremap] = sys_mremap,
-    [SYS_mprotect] = sys_mprotect,
-    [SYS_prlimit64] = sys_stub_nosys,
-    [SYS_rt_sigaction] = sys_rt_sigaction,
-    [SYS_gettimeofday] = sys_gettimeofday,
-    [SYS_times] = sys_times,
-    [SYS_writev] = sys_writev,
-    [SYS_faccessat] = sys_faccessat,
-    [SYS_fcntl] = sys_fcntl,
-    [SYS_ftruncate] = sys_ftruncate,
-    [SYS_getdents] = sys_getdents,
-    [SYS_dup] = sys_dup,
-    [SYS_dup3] = sys_dup3,
-    [SYS_readlinkat] = sys_stub_nosys,
-    [SYS_rt_sigprocmask] = sys_stub_success,
-    [SYS_ioctl] = sys_stub_nosys,
-    [SYS_clock_gettime] = sys_clock_gettime,
-    [SYS_getrusage] = sys_stub_nosys,
-    [SYS_getrlimit] = sys_stub_nosys,
-    [SYS_setrlimit] = sys_stub_nosys,
-    [SYS_chdir] = sys_chdir,
-    [SYS_set_tid_address] = sys_stub_nosys,
-    [SYS_set_robust_list] = sys_stub_nosys,
-    [SYS_madvise] = sys_stub_nosys,
-  };
-
   const static void* old_syscall_table[] = {
     [-OLD_SYSCALL_THRESHOLD + SYS_open] = sys_open,
     [-OLD_SYSCALL_THRESHOLD + SYS_link] = sys_link,
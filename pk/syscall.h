@@ -3,6 +3,8 @@
 #ifndef _PK_SYSCALL_H
 #define _PK_SYSCALL_H
 
+#include <stdint.h>
+
 #define SYS_exit 93
 #define SYS_exit_group 94
 #define SYS_getpid 172
@@ -33,6 +35,7 @@
 #define SYS_munmap 215
 #define SYS_mremap 216
 #define SYS_mprotect 226
+#define SYS_msync 227
 #define SYS_prlimit64 261
 #define SYS_getmainvars 2011
 #define SYS_rt_sigaction 134
@@ -51,6 +54,7 @@
 #define SYS_setrlimit 164
 #define SYS_getrusage 165
 #define SYS_clock_gettime 113
+#define SYS_clock_getres 114
 #define SYS_set_tid_address 96
 #define SYS_set_robust_list 99
 #define SYS_madvise 233
@@ -73,5 +77,7 @@
 #define AT_FDCWD -100
 
 long do_syscall(long a0, long a1, long a2, long a3, long a4, long a5, unsigned long n);
+void clock_init();
+uintptr_t map_vdso();
 
 #endif
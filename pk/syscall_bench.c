@@ -0,0 +1,73 @@
+// See LICENSE for license details.
+
+// A user program that times system calls, to measure what a trap into pk
+// costs.  Build it with "make syscall_bench" and run "pk syscall_bench".
+// Every call in pk's syscall table takes the short path through
+// trap_entry; for the full path, run it under a pk built from before that
+// path was added.
+
+#include "syscall.h"
+#include <stdint.h>
+
+#define CALLS 10000
+
+static long syscall(long n, long arg0, long arg1, long arg2)
+{
+  register long a0 asm ("a0") = arg0;
+  register long a1 asm ("a1") = arg1;
+  register long a2 asm ("a2") = arg2;
+  register long a7 asm ("a7") = n;
+  asm volatile ("ecall" : "+r" (a0) : "r" (a1), "r" (a2), "r" (a7) : "memory");
+  return a0;
+}
+
+static inline uintptr_t rdcycle()
+{
+  uintptr_t cycles;
+  asm volatile ("rdcycle %0" : "=r" (cycles));
+  return cycles;
+}
+
+static void print(const char* s)
+{
+  const char* e = s;
+  while (*e)
+    e++;
+  syscall(SYS_write, 1, (long)s, e - s);
+}
+
+static void print_num(uintptr_t n)
+{
+  char buf[24], *p = buf + sizeof(buf);
+  *--p = 0;
+  do
+    *--p = '0' + n % 10;
+  while (n /= 10);
+  print(p);
+}
+
+static void bench(const char* name, long n)
+{
+  uintptr_t start = rdcycle();
+  for (int i = 0; i < CALLS; i++)
+    syscall(n, 0, 0, 0);
+  uintptr_t cycles = rdcycle() - start;
+
+  print(name);
+  print(": ");
+  print_num(cycles / CALLS);
+  print(" cycles per call\n");
+}
+
+void bench_main()
+{
+  bench("getpid", SYS_getpid);
+  bench("getuid", SYS_getuid);
+  syscall(SYS_exit, 0, 0, 0);
+}
+
+// pk enters here with the stack already set up
+asm (".text\n"
+     ".globl _start\n"
+     "_start:\n"
+     "  j bench_main\n");
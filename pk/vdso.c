@@ -0,0 +1,62 @@
+// See LICENSE for license details.
+
+// The time syscalls, answered in user mode from the time CSR and the
+// parameters pk leaves in the page below.  This is built into a shared
+// object of its own, which pk maps into the program and names with
+// AT_SYSINFO_EHDR; it runs in user mode, so it can't call into pk.
+
+#include "vdso.h"
+#include <stddef.h>
+#include <errno.h>
+
+// The vDSO is linked without libgcc, so on cores without M, whose 64-bit
+// arithmetic would need it, it exports nothing and libc makes the syscalls.
+#ifdef __riscv_muldiv
+
+extern const struct vdso_data _vdso_data __attribute__((visibility("hidden")));
+
+static uint64_t ticks()
+{
+#if __riscv_xlen == 32
+  uint32_t lo, hi, hi2;
+  do {
+    asm volatile ("rdtimeh %0; rdtime %1; rdtimeh %2" : "=r"(hi), "=r"(lo), "=r"(hi2));
+  } while (hi != hi2);
+  return ((uint64_t)hi << 32) | lo;
+#else
+  uint64_t t;
+  asm volatile ("rdtime %0" : "=r"(t));
+  return t;
+#endif
+}
+
+int __vdso_clock_gettime(int clk_id, long* ts)
+{
+  int64_t ns = clock_ns(&_vdso_data, clk_id, ticks());
+  if (ns < 0)
+    return -EINVAL;
+  ns_to_timespec(ns, ts);
+  return 0;
+}
+
+int __vdso_clock_getres(int clk_id, long* ts)
+{
+  if (clock_ns(&_vdso_data, clk_id, 0) < 0)
+    return -EINVAL;
+  if (ts) {
+    ts[0] = 0;
+    ts[1] = _vdso_data.res_ns;
+  }
+  return 0;
+}
+
+int __vdso_gettimeofday(long* tv, void* tz)
+{
+  if (tv) {
+    ns_to_timespec(clock_ns(&_vdso_data, CLOCK_REALTIME, ticks()), tv);
+    tv[1] /= 1000;
+  }
+  return 0;
+}
+
+#endif
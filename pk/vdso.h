@@ -0,0 +1,88 @@
+// See LICENSE for license details.
+
+#ifndef _PK_VDSO_H
+#define _PK_VDSO_H
+
+#include <stdint.h>
+
+// The clocks are the time CSR, scaled to nanoseconds.  The syscalls and
+// the vDSO share the arithmetic below, which gets by without dividing.
+
+#define CLOCK_REALTIME 0
+#define CLOCK_MONOTONIC 1
+#define CLOCK_PROCESS_CPUTIME_ID 2
+#define CLOCK_THREAD_CPUTIME_ID 3
+#define CLOCK_MONOTONIC_RAW 4
+#define CLOCK_REALTIME_COARSE 5
+#define CLOCK_MONOTONIC_COARSE 6
+#define CLOCK_BOOTTIME 7
+
+#define NSEC_PER_SEC 1000000000ULL
+
+// What pk leaves for the vDSO in the page just below it
+struct vdso_data {
+  uint64_t ns_mult;     // nanoseconds per tick, in 32.32 fixed point
+  uint64_t res_ns;      // nanoseconds per tick, rounded up
+  uint64_t start_ticks; // when the program started
+};
+
+// The high half of the 128-bit product a * b
+static inline uint64_t mulhi64(uint64_t a, uint64_t b)
+{
+#if __riscv_xlen == 64
+  return ((unsigned __int128)a * b) >> 64;
+#else
+  uint64_t a_lo = (uint32_t)a, a_hi = a >> 32;
+  uint64_t b_lo = (uint32_t)b, b_hi = b >> 32;
+  uint64_t mid1 = a_hi * b_lo, mid2 = a_lo * b_hi;
+  uint64_t carry = (((a_lo * b_lo) >> 32) + (uint32_t)mid1 + (uint32_t)mid2) >> 32;
+  return a_hi * b_hi + (mid1 >> 32) + (mid2 >> 32) + carry;
+#endif
+}
+
+// (ticks * mult) >> 32, exactly, without a 128-bit product
+static inline uint64_t ticks_to_ns(uint64_t ticks, uint64_t mult)
+{
+  uint64_t t_lo = (uint32_t)ticks, t_hi = ticks >> 32;
+  uint64_t m_lo = (uint32_t)mult, m_hi = mult >> 32;
+  return ((t_hi * m_hi) << 32) + t_hi * m_lo + t_lo * m_hi + ((t_lo * m_lo) >> 32);
+}
+
+// Split ns into seconds and nanoseconds.  Multiplying by floor(2^64 / 10^9)
+// and keeping the high half gives a quotient at most one short, which a
+// single compare puts right.
+static inline void ns_to_timespec(uint64_t ns, long* ts)
+{
+  uint64_t sec = mulhi64(ns, 18446744073ULL);
+  uint64_t rem = ns - sec * NSEC_PER_SEC;
+  if (rem >= NSEC_PER_SEC) {
+    sec++;
+    rem -= NSEC_PER_SEC;
+  }
+  ts[0] = sec;
+  ts[1] = rem;
+}
+
+// The time on clock clk_id, in nanoseconds, or -1 if there's no such
+// clock.  There is no battery-backed clock, so the realtime clocks count
+// from reset like the monotonic ones; and as pk never idles, the program
+// uses the CPU for all the time since it started.
+static inline int64_t clock_ns(const struct vdso_data* d, int clk_id, uint64_t now)
+{
+  switch (clk_id) {
+    case CLOCK_REALTIME:
+    case CLOCK_MONOTONIC:
+    case CLOCK_MONOTONIC_RAW:
+    case CLOCK_REALTIME_COARSE:
+    case CLOCK_MONOTONIC_COARSE:
+    case CLOCK_BOOTTIME:
+      return ticks_to_ns(now, d->ns_mult);
+    case CLOCK_PROCESS_CPUTIME_ID:
+    case CLOCK_THREAD_CPUTIME_ID:
+      return ticks_to_ns(now - d->start_ticks, d->ns_mult);
+    default:
+      return -1;
+  }
+}
+
+#endif